@@ -2,7 +2,11 @@
 #define MY_UTILS
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
+#ifdef _WIN32
 size_t getline(char **lineptr, size_t *n, FILE *stream)
 {
   size_t pos = 0;
@@ -57,4 +61,173 @@ size_t getline(char **lineptr, size_t *n, FILE *stream)
   (*lineptr)[pos] = '\0';
   return pos;
 }
+#else
+// The few Win32 threading, timing and CRT calls the editor core uses, on top
+// of pthreads and POSIX clocks.
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef unsigned int DWORD;
+typedef void *HANDLE;
+typedef int BOOL;
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+typedef DWORD (*LPTHREAD_START_ROUTINE)(void *);
+
+#define WINAPI
+#define INFINITE 0xFFFFFFFF
+
+typedef union
+{
+  long long QuadPart;
+} LARGE_INTEGER;
+
+typedef struct
+{
+  DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+  pthread_mutex_init(cs, NULL);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+  pthread_mutex_lock(cs);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+  pthread_mutex_unlock(cs);
+}
+
+void InitializeConditionVariable(CONDITION_VARIABLE *cv)
+{
+  pthread_cond_init(cv, NULL);
+}
+
+// Only waits without a timeout are used.
+BOOL SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms)
+{
+  (void)ms;
+  return pthread_cond_wait(cv, cs) == 0;
+}
+
+void WakeConditionVariable(CONDITION_VARIABLE *cv)
+{
+  pthread_cond_signal(cv);
+}
+
+void WakeAllConditionVariable(CONDITION_VARIABLE *cv)
+{
+  pthread_cond_broadcast(cv);
+}
+
+typedef struct threadStart
+{
+  LPTHREAD_START_ROUTINE routine;
+  void *param;
+} threadStart;
+
+void *threadTrampoline(void *arg)
+{
+  threadStart start = *(threadStart *)arg;
+  free(arg);
+  start.routine(start.param);
+  return NULL;
+}
+
+// Threads are detached right away; the handle is only good for CloseHandle.
+HANDLE CreateThread(void *attr, size_t stack, LPTHREAD_START_ROUTINE routine, void *param, DWORD flags, DWORD *id)
+{
+  (void)attr;
+  (void)stack;
+  (void)flags;
+  (void)id;
+  threadStart *start = malloc(sizeof(threadStart));
+  if (start == NULL)
+    return NULL;
+  start->routine = routine;
+  start->param = param;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, threadTrampoline, start) != 0)
+  {
+    free(start);
+    return NULL;
+  }
+  pthread_detach(thread);
+  // The trampoline frees start, so the handle is just a non-NULL token.
+  return (HANDLE)1;
+}
+
+BOOL CloseHandle(HANDLE h)
+{
+  (void)h;
+  return 1;
+}
+
+void GetSystemInfo(SYSTEM_INFO *info)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  info->dwNumberOfProcessors = n > 0 ? (DWORD)n : 1;
+}
+
+DWORD GetTickCount()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (DWORD)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void Sleep(DWORD ms)
+{
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+  freq->QuadPart = 1000000000LL;
+  return 1;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  count->QuadPart = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  return 1;
+}
+
+#define _strdup strdup
+#define sscanf_s sscanf
+
+int fopen_s(FILE **fp, const char *filename, const char *mode)
+{
+  *fp = fopen(filename, mode);
+  return *fp ? 0 : errno;
+}
+
+int strcpy_s(char *dest, size_t size, const char *src)
+{
+  snprintf(dest, size, "%s", src);
+  return 0;
+}
+#endif
+
+// Index of the lowest set bit, x must not be zero.
+int ctz32(unsigned int x)
+{
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int)i;
+#else
+  return __builtin_ctz(x);
+#endif
+}
 #endif
\ No newline at end of file
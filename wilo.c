@@ -3,15 +3,36 @@
 */
 
 /*** includes ***/
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
+#ifdef _WIN32
 #include <windows.h>
-#include <ctype.h>
 #include <conio.h>
 #include <Synchapi.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+#include <ctype.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(_M_X64) || defined(__SSE2__)
+#define WILO_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "utils.h"
 
 /*** defines ***/
@@ -19,6 +40,29 @@
 #define WILO_VERSION "0.0.1"
 #define WILO_TAB_STOP 4
 #define WILO_QUIT_TIMES 3
+#define WILO_HL_IDLE_ROWS 2048
+#define WILO_HL_BATCH_ROWS 8192
+#define WILO_HL_PARALLEL_ROWS 65536
+#define WILO_HL_CHUNK_ROWS 4096
+#define WILO_FIND_CHUNK_ROWS 16384
+#define WILO_INDEX_BITS 18
+#define WILO_INDEX_BLOCK 32
+#define WILO_INDEX_PROBES 3
+#define WILO_REGEX_STATES 4096
+#define WILO_REGEX_MIN_BYTES_PER_STATE 10
+#define WILO_REGEX_MAX_INSTS 20000
+#define WILO_REGEX_MAX_REPEAT 1000
+#define WILO_MAX_WORKERS 64
+#define WILO_FRAME_MS 16
+#define WILO_INPUT_BUDGET_MS 50
+#define WILO_STATUS_MS 5000
+#define WILO_MAX_TIMERS 8
+#define WILO_ESC_MS 20
+#define WILO_PASTE_MS 1000
+
+#define SCREEN_DEFAULT 39
+#define SCREEN_INVERSE 0x80
+#define SCREEN_GAP 4
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
@@ -34,6 +78,8 @@ enum editorKey
   END_KEY,
   PAGE_UP,
   PAGE_DOWN,
+  PASTE_START,
+  PASTE_END,
 };
 
 enum editorHighlight
@@ -53,8 +99,52 @@ enum editorHighlight
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 #define HL_HIGHLIGHT_FUNCTIONS (1 << 2)
 
+#define CC_SEPARATOR (1 << 0)
+#define CC_DIGIT (1 << 1)
+#define CC_FUNCTION_STOP (1 << 2)
+
+enum editorLexState
+{
+  LEX_SEPARATOR = 0,
+  LEX_WORD,
+  LEX_NUMBER,
+  LEX_STRING_DQ,
+  LEX_STRING_SQ,
+  LEX_MLCOMMENT,
+  LEX_STATES,
+};
+
+#define LEX_SLOW 0x8000
+
 /*** data ***/
 
+typedef struct editorSyntaxTables
+{
+  unsigned char charclass[256];
+  unsigned int seed;
+  unsigned int mask;
+  int *slots;
+  unsigned int *hashes;
+  int *lens;
+  unsigned char *types;
+  // The keywords of the syntax, so the lexer needs nothing but the tables.
+  char **keywords;
+  int numkeywords;
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+  unsigned char lexclass[256];
+  int numlexclasses;
+  unsigned short *lex;
+} editorSyntaxTables;
+
+typedef struct editorLexer
+{
+  int in_comment;
+  int in_string;
+  int prev_sep;
+} editorLexer;
+
 typedef struct editorSyntax
 {
   char *filetype;
@@ -64,19 +154,99 @@ typedef struct editorSyntax
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  editorSyntaxTables *tables;
 } editorSyntax;
 
+// A run of render bytes with the same highlight. Rows only keep runs that
+// are not HL_NORMAL, sorted by start; longer runs are split at HL_SPAN_MAX.
+typedef struct hlSpan
+{
+  int start;
+  unsigned short len;
+  unsigned char hl;
+} hlSpan;
+
+#define HL_SPAN_MAX 0xffff
+
 typedef struct erow
 {
-  int idx;
   int size;
   int rsize;
   char *chars;
   char *render;
-  unsigned char *hl;
+  hlSpan *hl;
+  int hlspans;
+  int hl_start;
   int hl_open_comment;
+  int stale;
+  unsigned int version;
+  unsigned int id;
 } erow;
 
+typedef struct addBlock
+{
+  struct addBlock *next;
+  size_t len;
+  size_t cap;
+  char *data;
+} addBlock;
+
+typedef struct pieceTable
+{
+  char *orig;
+  size_t origlen;
+  int origowned;
+  addBlock *add;
+  size_t addlen;
+} pieceTable;
+
+// Per-thread buffers for rendering and highlighting a row.
+typedef struct hlScratch
+{
+  char *render;
+  unsigned char *hl;
+  int cap;
+} hlScratch;
+
+// One byte of text and one attribute byte per cell. An attribute is the SGR
+// foreground color, with SCREEN_INVERSE set for reverse video.
+typedef struct screenBuffer
+{
+  int rows;
+  int cols;
+  char *chars;
+  unsigned char *attrs;
+} screenBuffer;
+
+// The cells last drawn for a row, reused while the row's content, highlight
+// start state and the horizontal viewport stay the same.
+typedef struct rowCacheEntry
+{
+  unsigned int version;
+  int hl_start;
+  unsigned int hlepoch;
+  int coloff;
+  char *chars;
+  unsigned char *attrs;
+} rowCacheEntry;
+
+typedef struct rowCache
+{
+  int size;
+  int cols;
+  rowCacheEntry *entries;
+  unsigned long hits;
+  unsigned long misses;
+} rowCache;
+
+// Search match drawn over the row's highlight, in render offsets.
+typedef struct hlMatch
+{
+  int row;
+  int start;
+  int len;
+} hlMatch;
+
 struct editorConfig
 {
   int cx, cy;
@@ -87,15 +257,36 @@ struct editorConfig
   int screencols;
   int numrows;
   erow *row;
+  int rowcap;
+  int rowgap;
+  int hlvalid;
+  unsigned int hlepoch;
+  unsigned int rowversion;
+  unsigned long hldiscarded;
+  int redraw;
+  hlScratch scratch;
+  int piecetable;
+  pieceTable pt;
   int dirty;
   char *filename;
   char statusmsg[80];
-  time_t statusmsg_time;
   editorSyntax *syntax;
+  hlMatch match;
+  screenBuffer frame;
+  screenBuffer shadow;
+  int shadowvalid;
+  int shadowrowoff;
+  DWORD frametick;
+  rowCache rowcache;
+#ifdef _WIN32
   DWORD origInMode;
   DWORD origOutMode;
   HANDLE hStdin;
   HANDLE hStdout;
+  HANDLE hWake;
+#else
+  struct termios origTermios;
+#endif
 };
 
 struct editorConfig E;
@@ -118,6 +309,8 @@ editorSyntax HLDB[] = {
         "/*",
         "*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_FUNCTIONS,
+        // Built from the keywords when the syntax is first used.
+        NULL,
     },
 };
 
@@ -125,12 +318,266 @@ editorSyntax HLDB[] = {
 
 /*** prototypes ***/
 
+void die(const char *s);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+erow *editorRowAt(int at);
+int editorRowIndex(erow *row);
+int editorSyntaxIdle();
+void editorIndexIdle();
+void editorIndexOpen(int first, int mapped);
+void editorIndexCancel();
+int editorIndexCandidates(const char *query, int len, int **rows);
+void indexRowInserted(erow *row);
+void indexRowChanged(erow *row);
+void indexRowsMoved();
+void editorSyntaxParallel();
+void editorLexCompile(editorSyntax *syntax, editorSyntaxTables *t);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int termWrite(char *buff, int bytesToWrite);
+int getCursorPosition(int *rows, int *cols);
+void editorResize();
+
+/*** timers ***/
+
+// Work that has to happen later, such as clearing the status message, waits
+// in a small queue. The input wait sleeps until the earliest deadline, so an
+// idle editor with nothing queued does not wake up at all.
+
+typedef void (*timerCallback)();
+
+typedef struct editorTimer
+{
+  DWORD due;
+  timerCallback callback;
+} editorTimer;
+
+typedef struct timerQueue
+{
+  int count;
+  editorTimer timers[WILO_MAX_TIMERS];
+} timerQueue;
+
+timerQueue timers;
+
+// Runs callback delay ms from now, replacing an earlier request for the same
+// callback.
+void timerSet(DWORD delay, timerCallback callback)
+{
+  int i = 0;
+  while (i < timers.count && timers.timers[i].callback != callback)
+    i++;
+  if (i == timers.count)
+  {
+    if (timers.count == WILO_MAX_TIMERS)
+      die("timerSet");
+    timers.count++;
+  }
+  timers.timers[i].due = GetTickCount() + delay;
+  timers.timers[i].callback = callback;
+}
+
+// Milliseconds until the next timer is due, or INFINITE when none is queued.
+DWORD timerNext()
+{
+  DWORD now = GetTickCount();
+  DWORD next = INFINITE;
+  for (int i = 0; i < timers.count; i++)
+  {
+    int left = (int)(timers.timers[i].due - now);
+    if (left < 0)
+      left = 0;
+    if ((DWORD)left < next)
+      next = left;
+  }
+  return next;
+}
+
+void timerRun()
+{
+  DWORD now = GetTickCount();
+  int i = 0;
+  while (i < timers.count)
+  {
+    if ((int)(timers.timers[i].due - now) > 0)
+    {
+      i++;
+      continue;
+    }
+    // The callback may queue timers of its own.
+    timerCallback callback = timers.timers[i].callback;
+    timers.timers[i] = timers.timers[--timers.count];
+    callback();
+  }
+}
 
 /*** terminal ***/
 
+// Console input is decoded into key events as it is read. A key that is
+// held or repeated becomes one event with a repeat count, so the editor can
+// apply it in one step.
+typedef struct inputEvent
+{
+  int key;
+  int repeat;
+} inputEvent;
+
+// One console read holds at most 64 records and each adds at most one event.
+#define WILO_INPUT_RING 128
+
+typedef struct inputRing
+{
+  inputEvent events[WILO_INPUT_RING];
+  unsigned int head;
+  unsigned int tail;
+  // Win32: the start of an escape sequence whose rest is in the next read.
+  char held[8];
+  int numheld;
+} inputRing;
+
+inputRing input;
+
+void inputPush(int key, int repeat)
+{
+  if (input.tail != input.head)
+  {
+    inputEvent *last = &input.events[(input.tail - 1) % WILO_INPUT_RING];
+    if (last->key == key)
+    {
+      last->repeat += repeat;
+      return;
+    }
+  }
+  if (input.tail - input.head == WILO_INPUT_RING)
+    return;
+  inputEvent *ev = &input.events[input.tail++ % WILO_INPUT_RING];
+  ev->key = key;
+  ev->repeat = repeat;
+}
+
+// Decodes the key at the start of s and returns the number of bytes it
+// used. Sequences the editor does not know are passed on byte by byte.
+int inputDecode(char *s, int len, int *key)
+{
+  *key = s[0];
+  if (s[0] != '\x1b' || len < 3)
+    return 1;
+
+  if (s[1] == '[')
+  {
+    if (s[2] >= 'A' && s[2] <= 'Z')
+    {
+      switch (s[2])
+      {
+      case 'A':
+        *key = ARROW_UP;
+        return 3;
+      case 'B':
+        *key = ARROW_DOWN;
+        return 3;
+      case 'C':
+        *key = ARROW_RIGHT;
+        return 3;
+      case 'D':
+        *key = ARROW_LEFT;
+        return 3;
+      case 'H':
+        *key = HOME_KEY;
+        return 3;
+      case 'F':
+        *key = END_KEY;
+        return 3;
+      }
+    }
+    else if (len >= 4 && s[3] == '~')
+    {
+      switch (s[2])
+      {
+      case '1':
+      case '7':
+        *key = HOME_KEY;
+        return 4;
+      case '3':
+        *key = DEL_KEY;
+        return 4;
+      case '4':
+      case '8':
+        *key = END_KEY;
+        return 4;
+      case '5':
+        *key = PAGE_UP;
+        return 4;
+      case '6':
+        *key = PAGE_DOWN;
+        return 4;
+      }
+    }
+    else if (len >= 6 && !memcmp(&s[2], "200~", 4))
+    {
+      *key = PASTE_START;
+      return 6;
+    }
+    else if (len >= 6 && !memcmp(&s[2], "201~", 4))
+    {
+      *key = PASTE_END;
+      return 6;
+    }
+  }
+  else if (s[1] == 'O')
+  {
+    switch (s[2])
+    {
+    case 'H':
+      *key = HOME_KEY;
+      return 3;
+    case 'F':
+      *key = END_KEY;
+      return 3;
+    }
+  }
+  return 1;
+}
+
+void inputDecodeBytes(char *s, int len)
+{
+  int i = 0;
+  while (i < len)
+  {
+    int key;
+    i += inputDecode(&s[i], len - i, &key);
+    inputPush(key, 1);
+  }
+}
+
+// Returns the length of what may be the start of an escape sequence that
+// inputDecode knows at the end of s, or 0.
+int inputIncomplete(char *s, int len)
+{
+  for (int i = len - 1; i >= 0 && i >= len - 5; i--)
+  {
+    if (s[i] != '\x1b')
+      continue;
+    char *seq = &s[i];
+    int n = len - i;
+    if (n < 3)
+      return n;
+    if (seq[1] != '[' || seq[2] < '0' || seq[2] > '9')
+      return 0;
+    for (int j = 3; j < n; j++)
+      if (seq[j] < '0' || seq[j] > '9')
+        return 0;
+    return n;
+  }
+  return 0;
+}
+
+// The platform backends below provide raw mode, terminal output (ttyWrite),
+// filling the input ring (ttyFill), the input wait (ttyWait) and its wakeup,
+// the window size (ttyGetWindowSize) and file mapping. Everything after them
+// is shared.
+
+#ifdef _WIN32
+
 int GetLastErrorAsString(char *messageBuffer, int bufferSize)
 {
   // Get the error message ID, if any.
@@ -147,17 +594,9 @@ int GetLastErrorAsString(char *messageBuffer, int bufferSize)
   return errorMessageID;
 }
 
-void die(const char *s)
-{
-  char message[1094];
-  printf("%s\n", s);
-  int errorId = GetLastErrorAsString(message, 1094);
-  printf("%s(%d): %s\n", s, errorId, message);
-  exit(1);
-}
-
 void disableRawMode()
 {
+  termWrite("\x1b[?2004l", 8);
   if (!(SetConsoleMode(E.hStdin, E.origInMode) && SetConsoleMode(E.hStdout, E.origOutMode) && SetConsoleCtrlHandler(NULL, FALSE)))
     die("disableRawMode");
 }
@@ -169,6 +608,9 @@ void enableRawMode()
   GetConsoleMode(E.hStdout, &E.origOutMode);
   DWORD rawIn = E.origInMode;
   rawIn &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT);
+  // Lets the terminal report a paste as one bracketed block.
+  rawIn |= ENABLE_VIRTUAL_TERMINAL_INPUT;
+  rawIn |= ENABLE_WINDOW_INPUT;
   rawIn |= (DISABLE_NEWLINE_AUTO_RETURN);
   DWORD rawOut = E.origOutMode;
   rawOut &= ~(ENABLE_WRAP_AT_EOL_OUTPUT | ENABLE_LVB_GRID_WORLDWIDE);
@@ -179,112 +621,123 @@ void enableRawMode()
     die("enableRawMode Out");
   if (!SetConsoleCtrlHandler(NULL, TRUE))
     die("enableRawMode Ctrl");
+  termWrite("\x1b[?2004h", 8);
 }
 
-int read(char *c, int numToRead)
+void inputWakeInit()
 {
-  static char backBuffer[64];
-  static int bufferLength = 0;
-  static int nextByte = 0;
-  if (bufferLength > nextByte)
-  {
-    *c = backBuffer[nextByte++];
+  if (E.hWake)
+    return;
+  E.hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (E.hWake == NULL)
+    die("CreateEvent");
+}
+
+void inputWake()
+{
+  SetEvent(E.hWake);
+}
+
+int ttyFill(DWORD timeout)
+{
+  if (input.tail != input.head)
     return 1;
-  }
-  else
-  {
-    bufferLength = 0;
-    nextByte = 0;
-  }
-  if (WaitForSingleObject(E.hStdin, 100) == WAIT_OBJECT_0)
+  if (WaitForSingleObject(E.hStdin, timeout) == WAIT_OBJECT_0)
   {
     INPUT_RECORD r[64];
     DWORD read;
+    char bytes[8 + 64];
+    int numbytes = input.numheld;
+    memcpy(bytes, input.held, input.numheld);
+    input.numheld = 0;
 
     if (!ReadConsoleInput(E.hStdin, r, 64, &read))
+    {
+      errno = EIO;
       return -1;
-    // TODO: Add repeater support
-    for (int i = 0; i < read; i++)
+    }
+    for (DWORD i = 0; i < read; i++)
     {
-      switch (r[i].EventType)
+      if (r[i].EventType == WINDOW_BUFFER_SIZE_EVENT)
       {
-      case KEY_EVENT:
-        if (!r[i].Event.KeyEvent.bKeyDown)
-        {
-          continue;
-        }
-        switch (r[i].Event.KeyEvent.wVirtualKeyCode)
-        {
-        case VK_UP:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = 'A';
-          break;
-        case VK_DOWN:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = 'B';
-          break;
-        case VK_RIGHT:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = 'C';
-          break;
-        case VK_LEFT:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = 'D';
-          break;
-        case VK_PRIOR:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = '5';
-          backBuffer[bufferLength++] = '~';
-          break;
-        case VK_NEXT:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = '6';
-          backBuffer[bufferLength++] = '~';
-          break;
-        case VK_HOME:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = '1';
-          backBuffer[bufferLength++] = '~';
-          break;
-        case VK_END:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = '4';
-          backBuffer[bufferLength++] = '~';
-          break;
-        case VK_DELETE:
-          backBuffer[bufferLength++] = '\x1b';
-          backBuffer[bufferLength++] = '[';
-          backBuffer[bufferLength++] = '3';
-          backBuffer[bufferLength++] = '~';
-          break;
-        default:
-          backBuffer[bufferLength++] = r[i].Event.KeyEvent.uChar.AsciiChar;
-        }
+        editorResize();
+        continue;
       }
+      if (r[i].EventType != KEY_EVENT || !r[i].Event.KeyEvent.bKeyDown)
+        continue;
+      int key = 0;
+      switch (r[i].Event.KeyEvent.wVirtualKeyCode)
+      {
+      case VK_UP:
+        key = ARROW_UP;
+        break;
+      case VK_DOWN:
+        key = ARROW_DOWN;
+        break;
+      case VK_RIGHT:
+        key = ARROW_RIGHT;
+        break;
+      case VK_LEFT:
+        key = ARROW_LEFT;
+        break;
+      case VK_PRIOR:
+        key = PAGE_UP;
+        break;
+      case VK_NEXT:
+        key = PAGE_DOWN;
+        break;
+      case VK_HOME:
+        key = HOME_KEY;
+        break;
+      case VK_END:
+        key = END_KEY;
+        break;
+      case VK_DELETE:
+        key = DEL_KEY;
+        break;
+      }
+      int repeat = r[i].Event.KeyEvent.wRepeatCount;
+      if (repeat < 1)
+        repeat = 1;
+      char c = r[i].Event.KeyEvent.uChar.AsciiChar;
+      if (key == 0 && (repeat == 1 || c == '\x1b'))
+      {
+        // VT input delivers escape sequences one character per record.
+        bytes[numbytes++] = c;
+        continue;
+      }
+      inputDecodeBytes(bytes, numbytes);
+      numbytes = 0;
+      inputPush(key ? key : c, repeat);
     }
-    if (bufferLength > nextByte)
-    {
-      *c = backBuffer[nextByte++];
-      return 1;
-    }
-    else
+    // A sequence split between reads is decoded with the next read, if one
+    // comes soon enough.
+    int held = inputIncomplete(bytes, numbytes);
+    if (held && WaitForSingleObject(E.hStdin, WILO_ESC_MS) == WAIT_OBJECT_0)
     {
-      bufferLength = 0;
-      nextByte = 0;
+      numbytes -= held;
+      memcpy(input.held, &bytes[numbytes], held);
+      input.numheld = held;
     }
+    inputDecodeBytes(bytes, numbytes);
   }
-  return 0;
+  else if (input.numheld)
+  {
+    inputDecodeBytes(input.held, input.numheld);
+    input.numheld = 0;
+  }
+  return input.tail != input.head;
+}
+
+// Sleeps until console input arrives, the background highlighter finishes a
+// batch, or timeout ms pass.
+void ttyWait(DWORD timeout)
+{
+  HANDLE handles[2] = {E.hStdin, E.hWake};
+  WaitForMultipleObjects(E.hWake ? 2 : 1, handles, FALSE, timeout);
 }
 
-int write(char *buff, int bytesToWrite)
+int ttyWrite(char *buff, int bytesToWrite)
 {
   DWORD bytesWritten;
   if ((WriteConsole(E.hStdout, buff, bytesToWrite, &bytesWritten, NULL) == 0))
@@ -292,7 +745,7 @@ int write(char *buff, int bytesToWrite)
   return bytesWritten;
 }
 
-int writeFile(char *filename, char *buf, int len)
+size_t writeFile(char *filename, char *buf, size_t len)
 {
   HANDLE hFile = CreateFileA(filename,
                              GENERIC_WRITE, FILE_SHARE_READ,
@@ -303,11 +756,17 @@ int writeFile(char *filename, char *buf, int len)
   if (hFile == INVALID_HANDLE_VALUE)
     return -1;
 
-  int numberOfBytesWritten;
-  if (!WriteFile(hFile, buf, len, &numberOfBytesWritten, NULL))
+  size_t written = 0;
+  while (written < len)
   {
-    CloseHandle(hFile);
-    return -1;
+    DWORD chunk = (len - written > 0x40000000) ? 0x40000000 : (DWORD)(len - written);
+    DWORD numberOfBytesWritten;
+    if (!WriteFile(hFile, buf + written, chunk, &numberOfBytesWritten, NULL))
+    {
+      CloseHandle(hFile);
+      return -1;
+    }
+    written += numberOfBytesWritten;
   }
 
   // NOTE: If this fails there could be junk data at the end of the file
@@ -318,123 +777,58 @@ int writeFile(char *filename, char *buf, int len)
   }
 
   CloseHandle(hFile);
-  return numberOfBytesWritten;
+  return written;
 }
 
-int editorReadKey()
+char *mapFile(char *filename, size_t *len)
 {
-  int nread;
-  char c;
-  while ((nread = read(&c, 1)) != 1)
-  {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
-  }
-  if (c == '\x1b')
-  {
-    char seq[3];
-    seq[2] = '\0';
-    if (read(&seq[0], 1) != 1)
-      return '\x1b';
-    if (read(&seq[1], 1) != 1)
-      return '\x1b';
+  HANDLE hFile = CreateFileA(filename,
+                             GENERIC_READ, FILE_SHARE_READ,
+                             NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             NULL);
 
-    if (seq[0] == '[')
-    {
-      if (seq[1] >= '0' && seq[1] <= '9')
-      {
-        if (read(&seq[2], 1) != 1)
-          return '\x1b';
-        if (seq[2] == '~')
-        {
-          switch (seq[1])
-          {
-          case '1':
-            return HOME_KEY;
-          case '3':
-            return DEL_KEY;
-          case '4':
-            return END_KEY;
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          case '7':
-            return HOME_KEY;
-          case '8':
-            return END_KEY;
-          }
-        }
-      }
-      else
-      {
-        switch (seq[1])
-        {
-        case 'A':
-          return ARROW_UP;
-        case 'B':
-          return ARROW_DOWN;
-        case 'C':
-          return ARROW_RIGHT;
-        case 'D':
-          return ARROW_LEFT;
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
-        }
-      }
-    }
-    else if (seq[0] == 'O')
-    {
-      switch (seq[1])
-      {
-      case 'H':
-        return HOME_KEY;
-      case 'F':
-        return END_KEY;
-      }
-    }
-    return '\x1b';
-  }
-  else
+  if (hFile == INVALID_HANDLE_VALUE)
+    return NULL;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile, &size))
   {
-    return c;
+    CloseHandle(hFile);
+    return NULL;
   }
-}
-
-int getCursorPosition(int *rows, int *cols)
-{
-  char buf[32];
-  unsigned int i = 0;
-
-  if (write("\x1b[6n", 4) != 4)
-    return -1;
+  *len = (size_t)size.QuadPart;
 
-  while (i < sizeof(buf) - 1)
+  // NOTE: Empty files can't be mapped
+  if (*len == 0)
   {
-    if (read(&buf[i], 1) != 1)
-      break;
-    if (buf[i] == 'R')
-      break;
-    i++;
+    CloseHandle(hFile);
+    return "";
   }
-  buf[i] = '\0';
 
-  if (buf[0] != '\x1b' || buf[1] != '[')
-    return -1;
-  if (sscanf_s(&buf[2], "%d;%d", rows, cols) != 2)
-    return -1;
+  HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(hFile);
+  if (hMap == NULL)
+    return NULL;
 
-  return 0;
+  // The view keeps the mapping and the file open after the handles are closed.
+  char *view = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(hMap);
+  return view;
 }
 
-int getWindowSize(int *rows, int *cols)
+void unmapFile(char *view, size_t len)
+{
+  if (len)
+    UnmapViewOfFile(view);
+}
+
+int ttyGetWindowSize(int *rows, int *cols)
 {
   CONSOLE_SCREEN_BUFFER_INFO consoleScreenBufferInfo;
   if (GetConsoleScreenBufferInfo(E.hStdout, &consoleScreenBufferInfo) == 0 || consoleScreenBufferInfo.srWindow.Right <= consoleScreenBufferInfo.srWindow.Left)
   {
-    if (write("\x1b[999C\x1b[999B", 12) != 12)
+    if (termWrite("\x1b[999C\x1b[999B", 12) != 12)
       return -1;
     return getCursorPosition(rows, cols);
   }
@@ -446,1031 +840,6821 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
-/*** syntax highlighting ***/
+#else
+
+// POSIX terminals: termios raw mode, stdin read in non-blocking chunks and a
+// self-pipe that wakes the poll in inputWait for background results and
+// SIGWINCH.
 
-int is_seperator(int c)
+// The terminal is only read and written once raw mode is on.
+int ttyin = -1;
+int ttyout = -1;
+int wakefd[2] = {-1, -1};
+volatile sig_atomic_t winchPending = 0;
+
+int GetLastErrorAsString(char *messageBuffer, int bufferSize)
 {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:", c) != NULL;
+  int err = errno;
+  if (err == 0)
+    return 0;
+  snprintf(messageBuffer, bufferSize, "%s", strerror(err));
+  return err;
 }
 
-void editorUpdateSyntax(erow *row)
+// Writes the whole buffer, so a frame goes out in as few write(2) calls as
+// the terminal accepts.
+int ttyWrite(char *buff, int bytesToWrite)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (E.syntax == NULL)
-    return;
-
-  char **keywords = E.syntax->keywords;
-
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
-
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-
-  int i = 0;
-  while (i < row->rsize)
+  int written = 0;
+  while (written < bytesToWrite)
   {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment)
-    {
-      if (!strncmp(&row->render[i], scs, scs_len))
-      {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-
-    if (mcs_len && mce_len && !in_string)
-    {
-      if (in_comment)
-      {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len))
-        {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-        }
-        else
-        {
-          i++;
-          continue;
-        }
-      }
-      else if (!strncmp(&row->render[i], mcs, mcs_len))
-      {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-    {
-      if (in_string)
-      {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize)
-        {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      }
-      else
-      {
-        if (c == '"' || c == '\'')
-        {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-    {
-
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER))
-      {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
-    if (prev_sep)
+    ssize_t n = write(ttyout, buff + written, bytesToWrite - written);
+    if (n == -1)
     {
-      int j;
-      for (j = 0; keywords[j]; j++)
-      {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) && is_seperator(row->render[i + klen]))
-        {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL)
-      {
-        prev_sep = 0;
+      if (errno == EINTR || errno == EAGAIN)
         continue;
-      }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_FUNCTIONS)
-    {
-      if (row->render[i] == '(')
-      {
-        for (int j = i - 1; j >= 0; j--)
-        {
-          int c = row->render[j];
-          if (isspace(c) || c == '\0' || strchr("!(", c) != NULL)
-            break;
-          row->hl[j] = HL_FUNCTION;
-        }
-      }
+      return -1;
     }
-
-    prev_sep = is_seperator(c);
-    i++;
+    written += n;
   }
+  return written;
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+void disableRawMode()
+{
+  termWrite("\x1b[?2004l", 8);
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.origTermios) == -1)
+    die("disableRawMode");
 }
 
-int editorSyntaxToColor(int hl)
+void inputWakeInit()
 {
-  switch (hl)
+  if (wakefd[0] != -1)
+    return;
+  if (pipe(wakefd) == -1)
+    die("pipe");
+  fcntl(wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakefd[1], F_SETFL, O_NONBLOCK);
+}
+
+void inputWake()
+{
+  char c = 0;
+  if (write(wakefd[1], &c, 1) == -1)
   {
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return 36;
-  case HL_STRING:
-    return 35;
-  case HL_FUNCTION:
-  case HL_KEYWORD1:
-    return 33;
-  case HL_KEYWORD2:
-    return 32;
-  case HL_NUMBER:
-    return 31;
-  case HL_MATCH:
-    return 34;
-  default:
-    return 37;
+    // A full pipe already has a wakeup pending.
   }
 }
 
-void editorSelectSyntaxHighlight()
+void editorHandleWinch(int sig)
 {
-  E.syntax = NULL;
-  if (E.filename == NULL)
-    return;
+  (void)sig;
+  winchPending = 1;
+  inputWake();
+}
 
-  char *ext = strrchr(E.filename, '.');
+void enableRawMode()
+{
+  if (tcgetattr(STDIN_FILENO, &E.origTermios) == -1)
+    die("tcgetattr");
+  atexit(disableRawMode);
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+  struct termios raw = E.origTermios;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  // Reads return what is there; waiting is done with poll.
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    die("enableRawMode");
+  ttyin = STDIN_FILENO;
+  ttyout = STDOUT_FILENO;
+
+  inputWakeInit();
+  signal(SIGWINCH, editorHandleWinch);
+  // Lets the terminal report a paste as one bracketed block.
+  termWrite("\x1b[?2004h", 8);
+}
+
+int ttyFill(DWORD timeout)
+{
+  if (input.tail != input.head)
+    return 1;
+  if (winchPending)
   {
-    editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i])
-    {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
-      {
-        E.syntax = s;
+    winchPending = 0;
+    editorResize();
+  }
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++)
-        {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
-    }
+  struct pollfd pfd = {ttyin, POLLIN, 0};
+  if (poll(&pfd, 1, timeout == INFINITE ? -1 : (int)timeout) <= 0)
+    return 0;
+  // A hung up or closed terminal fails with EIO, so a stale EAGAIN in errno
+  // does not keep the caller polling it.
+  if (!(pfd.revents & POLLIN) && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+  {
+    errno = EIO;
+    return -1;
+  }
+  char bytes[64 + 8];
+  int numbytes = read(ttyin, bytes, 64);
+  if (numbytes == -1)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  if (numbytes == 0)
+  {
+    errno = EIO;
+    return -1;
+  }
+  // A sequence split over the link is completed before it is decoded.
+  while (numbytes < (int)sizeof(bytes) && inputIncomplete(bytes, numbytes) &&
+         poll(&pfd, 1, WILO_ESC_MS) > 0)
+  {
+    int n = read(ttyin, &bytes[numbytes], sizeof(bytes) - numbytes);
+    if (n <= 0)
+      break;
+    numbytes += n;
   }
+  inputDecodeBytes(bytes, numbytes);
+  return input.tail != input.head;
 }
 
-/*** row operations ***/
-
-int editorRowCxtoRx(erow *row, int cx)
+// Sleeps until stdin is readable, the wake pipe is written to, or timeout ms
+// pass.
+void ttyWait(DWORD timeout)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++)
+  struct pollfd fds[2] = {{ttyin, POLLIN, 0}, {wakefd[0], POLLIN, 0}};
+  if (poll(fds, 2, timeout == INFINITE ? -1 : (int)timeout) > 0 && (fds[1].revents & POLLIN))
   {
-    if (row->chars[j] == '\t')
-      rx += (WILO_TAB_STOP - 1) - (rx % WILO_TAB_STOP);
-    rx++;
+    char drain[64];
+    while (read(wakefd[0], drain, sizeof(drain)) > 0)
+      ;
   }
-  return rx;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+int ttyGetWindowSize(int *rows, int *cols)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++)
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
   {
-    if (row->chars[cx] == '\t')
-      cur_rx += (WILO_TAB_STOP - 1) - (cur_rx % WILO_TAB_STOP);
-    cur_rx++;
-
-    if (cur_rx > rx)
-      return cx;
+    if (termWrite("\x1b[999C\x1b[999B", 12) != 12)
+      return -1;
+    return getCursorPosition(rows, cols);
   }
-  return cx;
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+  return 0;
 }
 
-void editorUpdateRow(erow *row)
+size_t writeFile(char *filename, char *buf, size_t len)
 {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-  {
-    if (row->chars[j] == '\t')
-      tabs++;
-  }
-  free(row->render);
-  row->render = malloc(row->size + tabs * (WILO_TAB_STOP - 1) + 1);
+  int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+  if (fd == -1)
+    return -1;
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++)
+  size_t written = 0;
+  while (written < len)
   {
-    if (row->chars[j] == '\t')
+    ssize_t n = write(fd, buf + written, len - written);
+    if (n == -1)
     {
-      row->render[idx++] = ' ';
-      while (idx % WILO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }
-    else
-    {
-      row->render[idx++] = row->chars[j];
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      return -1;
     }
+    written += n;
+  }
+
+  // NOTE: If this fails there could be junk data at the end of the file
+  if (ftruncate(fd, len) == -1)
+  {
+    close(fd);
+    return -1;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 
-  editorUpdateSyntax(row);
+  close(fd);
+  return written;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+char *mapFile(char *filename, size_t *len)
 {
-  if (at < 0 || at > E.numrows)
-    return;
-
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++)
-    E.row[j].idx++;
-
-  E.row[at].idx = at;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    return NULL;
+  }
+  *len = (size_t)st.st_size;
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+  // NOTE: Empty files can't be mapped
+  if (*len == 0)
+  {
+    close(fd);
+    return "";
+  }
 
-  E.numrows++;
-  E.dirty++;
+  // The mapping keeps the file open after the descriptor is closed.
+  char *view = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return view == MAP_FAILED ? NULL : view;
 }
 
-void editorFreeRow(erow *row)
+void unmapFile(char *view, size_t len)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  if (len)
+    munmap(view, len);
 }
 
-void editorDelRow(int at)
+#endif
+
+#ifdef WILO_BENCH
+
+// A virtual terminal for running the editor without a console. Output is
+// decoded into a grid of cells in the same encoding as E.frame, keys come
+// from a script of reads, and the window size is the size of the grid. It
+// understands the escapes wilo writes: cursor moves, erase, SGR colors and
+// reverse video, scroll regions with SU/SD, cursor visibility and the
+// cursor position report.
+typedef struct vterm
 {
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+  screenBuffer grid;
+  int cy;
+  int cx;
+  // The last column was written; the next character wraps first.
+  int wrap;
+  int top;
+  int bottom;
+  int cursorvisible;
+  int bracketedpaste;
+  unsigned char attr;
+  // An escape sequence split across writes.
+  char seq[32];
+  int seqlen;
+  // Each entry is delivered by one read.
+  char **keys;
+  int numkeys;
+  int nextkey;
+  int readwrites;
+  size_t bytes;
+  int writes;
+} vterm;
+
+vterm vt;
+
+void vtAttach(int rows, int cols)
+{
+  memset(&vt, 0, sizeof(vt));
+  vt.grid.rows = rows;
+  vt.grid.cols = cols;
+  vt.grid.chars = malloc(rows * cols);
+  vt.grid.attrs = malloc(rows * cols);
+  memset(vt.grid.chars, ' ', rows * cols);
+  memset(vt.grid.attrs, SCREEN_DEFAULT, rows * cols);
+  vt.bottom = rows - 1;
+  vt.cursorvisible = 1;
+  vt.attr = SCREEN_DEFAULT;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+void vtDetach()
 {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+  free(vt.grid.chars);
+  free(vt.grid.attrs);
+  memset(&vt, 0, sizeof(vt));
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+void vtScript(char **keys, int numkeys)
 {
-  printf("editorRowAppendString\r\n");
-  row->chars = realloc(row->chars, row->size + len + 1);
-  printf("editorRowAppendString\r\n");
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  printf("editorRowAppendString\r\n");
-  E.dirty++;
+  vt.keys = keys;
+  vt.numkeys = numkeys;
+  vt.nextkey = 0;
 }
 
-void editorRowDelChar(erow *row, int at)
+void vtErase(int y, int from, int to)
 {
-  if (at < 0 || at >= row->size)
-    return;
-
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+  memset(&vt.grid.chars[y * vt.grid.cols + from], ' ', to - from);
+  memset(&vt.grid.attrs[y * vt.grid.cols + from], SCREEN_DEFAULT, to - from);
 }
 
-/*** editor operations ***/
-
-void editorInsertChar(int c)
+// Moves lines [top, bottom] up by n, or down when n is negative, blanking
+// the lines scrolled in.
+void vtScroll(int top, int bottom, int n)
 {
-  if (E.cy == E.numrows)
-  {
-    editorInsertRow(E.numrows, "", 0);
-  }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  int cols = vt.grid.cols;
+  int height = bottom - top + 1;
+  int shift = n > 0 ? n : -n;
+  if (shift > height)
+    shift = height;
+  int keep = (height - shift) * cols;
+  int from = (n > 0 ? top + shift : top) * cols;
+  int to = (n > 0 ? top : top + shift) * cols;
+  memmove(&vt.grid.chars[to], &vt.grid.chars[from], keep);
+  memmove(&vt.grid.attrs[to], &vt.grid.attrs[from], keep);
+  int blank = n > 0 ? bottom - shift + 1 : top;
+  for (int y = blank; y < blank + shift; y++)
+    vtErase(y, 0, cols);
 }
 
-void editorInsertNewLine()
+void vtLineFeed()
 {
-  if (E.cx == 0)
-  {
-    editorInsertRow(E.cy, "", 0);
-  }
-  else
-  {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-  }
-  E.cy++;
-  E.cx = 0;
+  if (vt.cy == vt.bottom)
+    vtScroll(vt.top, vt.bottom, 1);
+  else if (vt.cy < vt.grid.rows - 1)
+    vt.cy++;
 }
 
-void editorDelChar()
+void vtPutChar(char c)
 {
-  if (E.cy == E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0)
-    return;
-
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0)
+  if (vt.wrap)
   {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+    vt.cx = 0;
+    vtLineFeed();
+    vt.wrap = 0;
   }
+  vt.grid.chars[vt.cy * vt.grid.cols + vt.cx] = c;
+  vt.grid.attrs[vt.cy * vt.grid.cols + vt.cx] = vt.attr;
+  if (vt.cx == vt.grid.cols - 1)
+    vt.wrap = 1;
   else
-  {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-  }
+    vt.cx++;
 }
 
-/*** file i/o ***/
+int vtClamp(int n, int max)
+{
+  return n < 0 ? 0 : n > max ? max : n;
+}
 
-char *editorRowsToString(int *buflen)
+// Applies the CSI sequence in vt.seq, which starts after "\x1b[".
+void vtControl()
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
+  char *p = &vt.seq[2];
+  int dec = *p == '?';
+  if (dec)
+    p++;
+  int params[4] = {0, 0, 0, 0};
+  int numparams = 0;
+  while ((*p >= '0' && *p <= '9') || *p == ';')
   {
-    totlen += E.row[j].size + 1;
+    if (*p == ';')
+      numparams++;
+    else if (numparams < 4)
+      params[numparams] = params[numparams] * 10 + *p - '0';
+    p++;
+  }
+  numparams++;
+  int n = params[0] ? params[0] : 1;
+  int rows = vt.grid.rows, cols = vt.grid.cols;
+
+  switch (*p)
+  {
+  case 'H':
+  case 'f':
+    vt.cy = vtClamp(n - 1, rows - 1);
+    vt.cx = vtClamp((params[1] ? params[1] : 1) - 1, cols - 1);
+    vt.wrap = 0;
+    break;
+  case 'A':
+    vt.cy = vtClamp(vt.cy - n, rows - 1);
+    vt.wrap = 0;
+    break;
+  case 'B':
+    vt.cy = vtClamp(vt.cy + n, rows - 1);
+    vt.wrap = 0;
+    break;
+  case 'C':
+    vt.cx = vtClamp(vt.cx + n, cols - 1);
+    vt.wrap = 0;
+    break;
+  case 'D':
+    vt.cx = vtClamp(vt.cx - n, cols - 1);
+    vt.wrap = 0;
+    break;
+  case 'K':
+    if (params[0] == 0)
+      vtErase(vt.cy, vt.cx, cols);
+    else if (params[0] == 1)
+      vtErase(vt.cy, 0, vt.cx + 1);
+    else
+      vtErase(vt.cy, 0, cols);
+    break;
+  case 'J':
+    for (int y = 0; y < rows; y++)
+    {
+      if (params[0] == 2 || (params[0] == 0 && y > vt.cy) || (params[0] == 1 && y < vt.cy))
+        vtErase(y, 0, cols);
+    }
+    if (params[0] == 0)
+      vtErase(vt.cy, vt.cx, cols);
+    else if (params[0] == 1)
+      vtErase(vt.cy, 0, vt.cx + 1);
+    break;
+  case 'm':
+    for (int i = 0; i < numparams && i < 4; i++)
+    {
+      if (params[i] == 0)
+        vt.attr = SCREEN_DEFAULT;
+      else if (params[i] == 7)
+        vt.attr |= SCREEN_INVERSE;
+      else if (params[i] == 27)
+        vt.attr &= ~SCREEN_INVERSE;
+      else
+        vt.attr = (vt.attr & SCREEN_INVERSE) | params[i];
+    }
+    break;
+  case 'r':
+    vt.top = vtClamp(n - 1, rows - 1);
+    vt.bottom = params[1] ? vtClamp(params[1] - 1, rows - 1) : rows - 1;
+    if (vt.top >= vt.bottom)
+    {
+      vt.top = 0;
+      vt.bottom = rows - 1;
+    }
+    vt.cy = vt.cx = vt.wrap = 0;
+    break;
+  case 'S':
+    vtScroll(vt.top, vt.bottom, n);
+    break;
+  case 'T':
+    vtScroll(vt.top, vt.bottom, -n);
+    break;
+  case 'h':
+  case 'l':
+    if (dec && params[0] == 25)
+      vt.cursorvisible = *p == 'h';
+    else if (dec && params[0] == 2004)
+      vt.bracketedpaste = *p == 'h';
+    break;
+  case 'n':
+    if (params[0] == 6)
+    {
+      char report[32];
+      int len = snprintf(report, sizeof(report), "\x1b[%d;%dR", vt.cy + 1, vt.cx + 1);
+      inputDecodeBytes(report, len);
+    }
+    break;
+  }
+}
+
+int vtWrite(char *buff, int bytesToWrite)
+{
+  vt.bytes += bytesToWrite;
+  vt.writes++;
+  for (int i = 0; i < bytesToWrite; i++)
+  {
+    char c = buff[i];
+    if (vt.seqlen)
+    {
+      if (vt.seqlen < (int)sizeof(vt.seq) - 1)
+        vt.seq[vt.seqlen++] = c;
+      // A CSI sequence ends with a byte in 0x40-0x7e; other escapes are
+      // two bytes long and ignored.
+      if (vt.seqlen == 2 && c != '[')
+        vt.seqlen = 0;
+      else if (vt.seqlen > 2 && c >= 0x40 && c <= 0x7e)
+      {
+        vt.seq[vt.seqlen] = '\0';
+        vtControl();
+        vt.seqlen = 0;
+      }
+    }
+    else if (c == '\x1b')
+    {
+      vt.seq[0] = c;
+      vt.seqlen = 1;
+    }
+    else if (c == '\r')
+    {
+      vt.cx = 0;
+      vt.wrap = 0;
+    }
+    else if (c == '\n')
+    {
+      vtLineFeed();
+      vt.wrap = 0;
+    }
+    else if ((unsigned char)c >= ' ' && c != 127)
+    {
+      vtPutChar(c);
+    }
+  }
+  return bytesToWrite;
+}
+
+// Like someone who waits for the screen to change before typing on, the
+// script delivers its next read only after a frame was written. It never
+// waits: with no read due it fails like a non-blocking read would.
+int vtFill()
+{
+  if (input.tail != input.head)
+    return 1;
+  if (vt.nextkey == vt.numkeys || vt.writes == vt.readwrites)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  vt.readwrites = vt.writes;
+  char *s = vt.keys[vt.nextkey++];
+  inputDecodeBytes(s, strlen(s));
+  return input.tail != input.head;
+}
+
+#endif
+
+// The headless benchmarks can attach the virtual terminal in place of the
+// real one.
+int termWrite(char *buff, int bytesToWrite)
+{
+#ifdef WILO_BENCH
+  if (vt.grid.chars)
+    return vtWrite(buff, bytesToWrite);
+#endif
+  return ttyWrite(buff, bytesToWrite);
+}
+
+int inputFill(DWORD timeout)
+{
+#ifdef WILO_BENCH
+  if (vt.grid.chars)
+    return vtFill();
+#endif
+  return ttyFill(timeout);
+}
+
+void inputWait(DWORD timeout)
+{
+#ifdef WILO_BENCH
+  if (vt.grid.chars)
+    return;
+#endif
+  ttyWait(timeout);
+}
+
+int getWindowSize(int *rows, int *cols)
+{
+#ifdef WILO_BENCH
+  if (vt.grid.chars)
+  {
+    *rows = vt.grid.rows;
+    *cols = vt.grid.cols;
+    return 0;
+  }
+#endif
+  return ttyGetWindowSize(rows, cols);
+}
+
+void die(const char *s)
+{
+  char message[1094];
+  printf("%s\n", s);
+  int errorId = GetLastErrorAsString(message, 1094);
+  printf("%s(%d): %s\n", s, errorId, message);
+  exit(1);
+}
+
+// Takes the next key event, or one press of it when single is set, waiting
+// up to timeout ms for one.
+int inputRead(int *key, int single, DWORD timeout)
+{
+  int avail = inputFill(timeout);
+  if (avail <= 0)
+    return avail;
+  inputEvent *ev = &input.events[input.head % WILO_INPUT_RING];
+  *key = ev->key;
+  int repeat = single ? 1 : ev->repeat;
+  ev->repeat -= repeat;
+  if (ev->repeat == 0)
+    input.head++;
+  return repeat;
+}
+
+int termRead(char *c)
+{
+  int key;
+  int nread = inputRead(&key, 1, 100);
+  if (nread > 0)
+    *c = key;
+  return nread;
+}
+
+// Waits up to timeout ms for a key. Key releases and other console events
+// wake the wait without producing one, so keep waiting past them.
+int inputPending(DWORD timeout)
+{
+  DWORD start = GetTickCount();
+  while (1)
+  {
+    DWORD elapsed = GetTickCount() - start;
+    int avail = inputFill(elapsed < timeout ? timeout - elapsed : 0);
+    if (avail != 0)
+      return avail > 0;
+    if (elapsed >= timeout)
+      return 0;
+  }
+}
+
+// Does the work that needs no key: applies background highlighting and a
+// finished index, runs due timers and redraws if any of them changed the
+// screen.
+void editorIdle()
+{
+  editorSyntaxIdle();
+  editorIndexIdle();
+  timerRun();
+  if (E.redraw)
+  {
+    E.redraw = 0;
+    editorRefreshScreen();
+  }
+}
+
+// Reads the next key and how many times it was pressed in a row. With
+// single set every press is returned on its own. Sleeps in between until
+// there is input, a highlighting result or a timer to handle.
+int editorReadKeyRepeat(int *repeat, int single)
+{
+  int key, nread;
+  while ((nread = inputRead(&key, single, 0)) <= 0)
+  {
+    if (nread == -1 && errno != EAGAIN)
+      die("read");
+    editorIdle();
+    inputWait(timerNext());
+  }
+  *repeat = nread;
+  return key;
+}
+
+int editorReadKey()
+{
+  int repeat;
+  return editorReadKeyRepeat(&repeat, 1);
+}
+
+int getCursorPosition(int *rows, int *cols)
+{
+  char buf[32];
+  unsigned int i = 0;
+
+  if (termWrite("\x1b[6n", 4) != 4)
+    return -1;
+
+  while (i < sizeof(buf) - 1)
+  {
+    if (termRead(&buf[i]) != 1)
+      break;
+    if (buf[i] == 'R')
+      break;
+    i++;
+  }
+  buf[i] = '\0';
+
+  if (buf[0] != '\x1b' || buf[1] != '[')
+    return -1;
+  if (sscanf_s(&buf[2], "%d;%d", rows, cols) != 2)
+    return -1;
+
+  return 0;
+}
+/*** worker pool ***/
+
+// Runs numtasks calls of a task function on a fixed set of threads. Workers
+// take task indices in order, and the worker index lets tasks keep
+// per-thread scratch buffers.
+
+typedef void (*poolTask)(int task, int worker, void *arg);
+
+typedef struct workerPool
+{
+  int numworkers;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+  CONDITION_VARIABLE done;
+  poolTask task;
+  void *arg;
+  int numtasks;
+  int next;
+  int running;
+} workerPool;
+
+workerPool pool;
+
+DWORD WINAPI poolWorker(void *param)
+{
+  int worker = (int)(size_t)param;
+  EnterCriticalSection(&pool.lock);
+  for (;;)
+  {
+    while (pool.next >= pool.numtasks)
+      SleepConditionVariableCS(&pool.wake, &pool.lock, INFINITE);
+    int task = pool.next++;
+    LeaveCriticalSection(&pool.lock);
+
+    pool.task(task, worker, pool.arg);
+
+    EnterCriticalSection(&pool.lock);
+    if (--pool.running == 0)
+      WakeAllConditionVariable(&pool.done);
+  }
+  return 0;
+}
+
+int poolSize()
+{
+  if (pool.numworkers == 0)
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int n = info.dwNumberOfProcessors;
+    if (n < 1)
+      n = 1;
+    if (n > WILO_MAX_WORKERS)
+      n = WILO_MAX_WORKERS;
+
+    InitializeCriticalSection(&pool.lock);
+    InitializeConditionVariable(&pool.wake);
+    InitializeConditionVariable(&pool.done);
+    for (int i = 0; i < n; i++)
+    {
+      HANDLE thread = CreateThread(NULL, 0, poolWorker, (void *)(size_t)i, 0, NULL);
+      if (thread == NULL)
+        die("CreateThread");
+      CloseHandle(thread);
+    }
+    pool.numworkers = n;
+  }
+  return pool.numworkers;
+}
+
+// Runs all tasks and returns when the last one has finished.
+void poolRun(int numtasks, poolTask task, void *arg)
+{
+  poolSize();
+  EnterCriticalSection(&pool.lock);
+  pool.task = task;
+  pool.arg = arg;
+  pool.next = 0;
+  pool.running = numtasks;
+  pool.numtasks = numtasks;
+  WakeAllConditionVariable(&pool.wake);
+  while (pool.running > 0)
+    SleepConditionVariableCS(&pool.done, &pool.lock, INFINITE);
+  pool.numtasks = 0;
+  pool.next = 0;
+  LeaveCriticalSection(&pool.lock);
+}
+
+/*** syntax highlighting ***/
+
+// Keywords are looked up through a perfect hash: the seed and table size are
+// searched once per syntax so that every keyword lands in its own slot.
+unsigned int editorKeywordHash(unsigned int seed, const char *s, int len)
+{
+  unsigned int h = 2166136261u ^ seed;
+  for (int i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+int editorKeywordLookup(editorSyntaxTables *t, const char *s, int len)
+{
+  if (t->numkeywords == 0)
+    return -1;
+  unsigned int h = editorKeywordHash(t->seed, s, len);
+  int k = t->slots[h & t->mask] - 1;
+  if (k < 0 || t->hashes[k] != h || t->lens[k] != len || memcmp(t->keywords[k], s, len))
+    return -1;
+  return k;
+}
+
+editorSyntaxTables *editorSyntaxCompile(editorSyntax *syntax)
+{
+  editorSyntaxTables *t = calloc(1, sizeof(editorSyntaxTables));
+  if (t == NULL)
+    die("calloc");
+
+  for (int c = 0; c < 256; c++)
+  {
+    if (c < 128 && (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:", c) != NULL))
+      t->charclass[c] |= CC_SEPARATOR;
+    if (c < 128 && isdigit(c))
+      t->charclass[c] |= CC_DIGIT;
+    if (c < 128 && (isspace(c) || c == '\0' || strchr("!(", c) != NULL))
+      t->charclass[c] |= CC_FUNCTION_STOP;
+  }
+
+  int n = 0;
+  while (syntax->keywords[n])
+    n++;
+  t->numkeywords = n;
+  t->keywords = syntax->keywords;
+  t->lens = malloc(sizeof(int) * (n + 1));
+  t->hashes = malloc(sizeof(unsigned int) * (n + 1));
+  t->types = malloc(n + 1);
+  for (int k = 0; k < n; k++)
+  {
+    int len = strlen(syntax->keywords[k]);
+    int kw2 = len > 0 && syntax->keywords[k][len - 1] == '|';
+    t->lens[k] = kw2 ? len - 1 : len;
+    t->types[k] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+
+  unsigned int size = 4;
+  while (size < (unsigned int)n * 2)
+    size *= 2;
+  for (;;)
+  {
+    t->slots = realloc(t->slots, sizeof(int) * size);
+    t->mask = size - 1;
+    for (t->seed = 1; t->seed <= 1000; t->seed++)
+    {
+      memset(t->slots, 0, sizeof(int) * size);
+      int k;
+      for (k = 0; k < n; k++)
+      {
+        char *kw = syntax->keywords[k];
+        unsigned int slot = editorKeywordHash(t->seed, kw, t->lens[k]) & t->mask;
+        if (t->slots[slot] == 0)
+        {
+          t->slots[slot] = k + 1;
+        }
+        else
+        {
+          // The first of two identical keywords wins, as in a linear search.
+          int other = t->slots[slot] - 1;
+          if (t->lens[other] != t->lens[k] || memcmp(syntax->keywords[other], kw, t->lens[k]))
+            break;
+        }
+      }
+      if (k == n)
+      {
+        for (k = 0; k < n; k++)
+          t->hashes[k] = editorKeywordHash(t->seed, syntax->keywords[k], t->lens[k]);
+        editorLexCompile(syntax, t);
+        return t;
+      }
+    }
+    size *= 2;
+  }
+}
+
+// Frees tables from editorSyntaxCompile. The keywords belong to the syntax.
+void editorSyntaxFree(editorSyntaxTables *t)
+{
+  if (t == NULL)
+    return;
+  free(t->slots);
+  free(t->hashes);
+  free(t->lens);
+  free(t->types);
+  free(t->lex);
+  free(t);
+}
+
+// The lexer runs on a state table indexed by state and byte class. Bytes
+// with the same meaning to the syntax share a class; an entry holds the
+// highlight to emit and the next state. Entries that depend on more than one
+// byte (comment delimiters, keywords, function names, string escapes) are
+// marked LEX_SLOW and go through editorSyntaxStep, the per-byte highlighter.
+
+#define LEX_SIG_SEPARATOR (1 << 0)
+#define LEX_SIG_DIGIT (1 << 1)
+#define LEX_SIG_DOT (1 << 2)
+#define LEX_SIG_DQUOTE (1 << 3)
+#define LEX_SIG_SQUOTE (1 << 4)
+#define LEX_SIG_BACKSLASH (1 << 5)
+#define LEX_SIG_LPAREN (1 << 6)
+#define LEX_SIG_CODE_DELIM (1 << 7)
+#define LEX_SIG_COMMENT_END (1 << 8)
+#define LEX_SIG_KEYWORD (1 << 9)
+
+unsigned short editorLexEntry(editorSyntax *syntax, int state, int sig, int emptykw)
+{
+  int strings = syntax->flags & HL_HIGHLIGHT_STRINGS;
+  int numbers = syntax->flags & HL_HIGHLIGHT_NUMBERS;
+  int functions = syntax->flags & HL_HIGHLIGHT_FUNCTIONS;
+
+  if (state == LEX_MLCOMMENT)
+  {
+    if (sig & LEX_SIG_COMMENT_END)
+      return LEX_SLOW;
+    return LEX_MLCOMMENT | (HL_MLCOMMENT << 4);
+  }
+
+  if (state == LEX_STRING_DQ || state == LEX_STRING_SQ)
+  {
+    if (sig & LEX_SIG_BACKSLASH)
+      return LEX_SLOW;
+    if (sig & (state == LEX_STRING_DQ ? LEX_SIG_DQUOTE : LEX_SIG_SQUOTE))
+      return LEX_SEPARATOR | (HL_STRING << 4);
+    return state | (HL_STRING << 4);
+  }
+
+  if (sig & LEX_SIG_CODE_DELIM)
+    return LEX_SLOW;
+  if (strings && (sig & LEX_SIG_DQUOTE))
+    return LEX_STRING_DQ | (HL_STRING << 4);
+  if (strings && (sig & LEX_SIG_SQUOTE))
+    return LEX_STRING_SQ | (HL_STRING << 4);
+  if (numbers && (sig & LEX_SIG_DIGIT) && state != LEX_WORD)
+    return LEX_NUMBER | (HL_NUMBER << 4);
+  if (numbers && (sig & LEX_SIG_DOT) && state == LEX_NUMBER)
+    return LEX_NUMBER | (HL_NUMBER << 4);
+  if (state == LEX_SEPARATOR && (emptykw || (sig & LEX_SIG_KEYWORD)))
+    return LEX_SLOW;
+  if (functions && (sig & LEX_SIG_LPAREN))
+    return LEX_SLOW;
+  return ((sig & LEX_SIG_SEPARATOR) ? LEX_SEPARATOR : LEX_WORD) | (HL_NORMAL << 4);
+}
+
+void editorLexCompile(editorSyntax *syntax, editorSyntaxTables *t)
+{
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  t->scs_len = scs ? strlen(scs) : 0;
+  t->mcs_len = mcs ? strlen(mcs) : 0;
+  t->mce_len = mce ? strlen(mce) : 0;
+  int mlcomments = t->mcs_len && t->mce_len;
+
+  int emptykw = 0;
+  unsigned short sigs[256];
+  for (int c = 0; c < 256; c++)
+  {
+    int sig = 0;
+    if (t->charclass[c] & CC_SEPARATOR)
+      sig |= LEX_SIG_SEPARATOR;
+    if (t->charclass[c] & CC_DIGIT)
+      sig |= LEX_SIG_DIGIT;
+    if (c == '.')
+      sig |= LEX_SIG_DOT;
+    if (c == '"')
+      sig |= LEX_SIG_DQUOTE;
+    if (c == '\'')
+      sig |= LEX_SIG_SQUOTE;
+    if (c == '\\')
+      sig |= LEX_SIG_BACKSLASH;
+    if (c == '(')
+      sig |= LEX_SIG_LPAREN;
+    if ((t->scs_len && c == (unsigned char)scs[0]) || (mlcomments && c == (unsigned char)mcs[0]))
+      sig |= LEX_SIG_CODE_DELIM;
+    if (mlcomments && c == (unsigned char)mce[0])
+      sig |= LEX_SIG_COMMENT_END;
+    sigs[c] = sig;
+  }
+  for (int k = 0; k < t->numkeywords; k++)
+  {
+    if (t->lens[k] == 0)
+      emptykw = 1;
+    else if (!(t->charclass[(unsigned char)syntax->keywords[k][0]] & CC_SEPARATOR))
+      sigs[(unsigned char)syntax->keywords[k][0]] |= LEX_SIG_KEYWORD;
+  }
+
+  unsigned short classes[256];
+  t->numlexclasses = 0;
+  for (int c = 0; c < 256; c++)
+  {
+    int k;
+    for (k = 0; k < t->numlexclasses; k++)
+    {
+      if (classes[k] == sigs[c])
+        break;
+    }
+    if (k == t->numlexclasses)
+      classes[t->numlexclasses++] = sigs[c];
+    t->lexclass[c] = k;
+  }
+
+  t->lex = malloc(sizeof(unsigned short) * LEX_STATES * t->numlexclasses);
+  for (int state = 0; state < LEX_STATES; state++)
+  {
+    for (int k = 0; k < t->numlexclasses; k++)
+      t->lex[state * t->numlexclasses + k] = editorLexEntry(syntax, state, classes[k], emptykw);
+  }
+}
+
+// One step of the per-byte highlighter at render[i]. Returns the index of the
+// next byte to look at.
+int editorSyntaxStep(editorSyntax *syntax, char *render, int rsize, unsigned char *hl, int i, editorLexer *lx)
+{
+  editorSyntaxTables *t = syntax->tables;
+  unsigned char *cc = t->charclass;
+
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+
+  int scs_len = t->scs_len;
+  int mcs_len = t->mcs_len;
+  int mce_len = t->mce_len;
+
+  char c = render[i];
+  unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+  if (scs_len && !lx->in_string && !lx->in_comment)
+  {
+    if (!strncmp(&render[i], scs, scs_len))
+    {
+      memset(&hl[i], HL_COMMENT, rsize - i);
+      return rsize;
+    }
+  }
+
+  if (mcs_len && mce_len && !lx->in_string)
+  {
+    if (lx->in_comment)
+    {
+      hl[i] = HL_MLCOMMENT;
+      if (!strncmp(&render[i], mce, mce_len))
+      {
+        memset(&hl[i], HL_MLCOMMENT, mce_len);
+        i += mce_len;
+        lx->in_comment = 0;
+        lx->prev_sep = 1;
+      }
+      else
+      {
+        return i + 1;
+      }
+    }
+    else if (!strncmp(&render[i], mcs, mcs_len))
+    {
+      memset(&hl[i], HL_MLCOMMENT, mcs_len);
+      lx->in_comment = 1;
+      return i + mcs_len;
+    }
+  }
+
+  if (syntax->flags & HL_HIGHLIGHT_STRINGS)
+  {
+    if (lx->in_string)
+    {
+      hl[i] = HL_STRING;
+      if (c == '\\' && i + 1 < rsize)
+      {
+        hl[i + 1] = HL_STRING;
+        return i + 2;
+      }
+      if (c == lx->in_string)
+        lx->in_string = 0;
+      lx->prev_sep = 1;
+      return i + 1;
+    }
+    else
+    {
+      if (c == '"' || c == '\'')
+      {
+        lx->in_string = c;
+        hl[i] = HL_STRING;
+        return i + 1;
+      }
+    }
+  }
+
+  if (syntax->flags & HL_HIGHLIGHT_NUMBERS)
+  {
+
+    if (((cc[(unsigned char)c] & CC_DIGIT) && (lx->prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER))
+    {
+      hl[i] = HL_NUMBER;
+      lx->prev_sep = 0;
+      return i + 1;
+    }
+  }
+  if (lx->prev_sep)
+  {
+    int len = 0;
+    while (!(cc[(unsigned char)render[i + len]] & CC_SEPARATOR))
+      len++;
+    int k = editorKeywordLookup(t, &render[i], len);
+    if (k >= 0)
+    {
+      memset(&hl[i], t->types[k], len);
+      lx->prev_sep = 0;
+      return i + len;
+    }
+  }
+
+  if (syntax->flags & HL_HIGHLIGHT_FUNCTIONS)
+  {
+    if (render[i] == '(')
+    {
+      for (int j = i - 1; j >= 0; j--)
+      {
+        if (cc[(unsigned char)render[j]] & CC_FUNCTION_STOP)
+          break;
+        hl[j] = HL_FUNCTION;
+      }
+    }
+  }
+
+  lx->prev_sep = cc[(unsigned char)c] & CC_SEPARATOR;
+  return i + 1;
+}
+
+// Highlights one rendered line starting in the given multi-line comment state
+// and returns the state at the end of the line.
+int editorSyntaxHighlight(editorSyntax *syntax, char *render, int rsize, unsigned char *hl, int in_comment)
+{
+  memset(hl, HL_NORMAL, rsize);
+
+  if (syntax == NULL)
+    return 0;
+
+  editorSyntaxTables *t = syntax->tables;
+  unsigned char *lexclass = t->lexclass;
+  unsigned short *lex = t->lex;
+  int n = t->numlexclasses;
+
+  int state = in_comment ? LEX_MLCOMMENT : LEX_SEPARATOR;
+  int i = 0;
+  while (i < rsize)
+  {
+    unsigned short e = lex[state * n + lexclass[(unsigned char)render[i]]];
+    if (!(e & LEX_SLOW))
+    {
+      hl[i++] = e >> 4;
+      state = e & 0xf;
+      continue;
+    }
+
+    editorLexer lx;
+    lx.in_comment = state == LEX_MLCOMMENT;
+    lx.in_string = state == LEX_STRING_DQ ? '"' : state == LEX_STRING_SQ ? '\'' : 0;
+    lx.prev_sep = state == LEX_SEPARATOR;
+    i = editorSyntaxStep(syntax, render, rsize, hl, i, &lx);
+
+    if (lx.in_comment)
+      state = LEX_MLCOMMENT;
+    else if (lx.in_string)
+      state = lx.in_string == '"' ? LEX_STRING_DQ : LEX_STRING_SQ;
+    else if (lx.prev_sep)
+      state = LEX_SEPARATOR;
+    else
+      state = (i > 0 && hl[i - 1] == HL_NUMBER) ? LEX_NUMBER : LEX_WORD;
+  }
+
+  return state == LEX_MLCOMMENT;
+}
+
+// Run-length encodes a per-byte highlight into spans, leaving out HL_NORMAL.
+int editorSyntaxToSpans(unsigned char *hl, int rsize, hlSpan **spans)
+{
+  int n = 0;
+  for (int i = 0, len = 0; i < rsize; i++)
+  {
+    len = (i > 0 && hl[i] == hl[i - 1] && len < HL_SPAN_MAX) ? len + 1 : 1;
+    if (hl[i] != HL_NORMAL && len == 1)
+      n++;
+  }
+
+  *spans = realloc(*spans, sizeof(hlSpan) * n);
+  n = 0;
+  for (int i = 0; i < rsize;)
+  {
+    int j = i + 1;
+    while (j < rsize && hl[j] == hl[i] && j - i < HL_SPAN_MAX)
+      j++;
+    if (hl[i] != HL_NORMAL)
+    {
+      (*spans)[n].start = i;
+      (*spans)[n].len = j - i;
+      (*spans)[n].hl = hl[i];
+      n++;
+    }
+    i = j;
+  }
+  return n;
+}
+
+void hlScratchReserve(hlScratch *s, int need)
+{
+  if (need > s->cap)
+  {
+    s->cap = need * 2;
+    s->render = realloc(s->render, s->cap);
+    s->hl = realloc(s->hl, s->cap);
+  }
+}
+
+void editorUpdateSyntax(erow *row, int start, hlScratch *s)
+{
+  hlScratchReserve(s, row->rsize);
+  row->hl_start = start;
+  row->hl_open_comment = editorSyntaxHighlight(E.syntax, row->render, row->rsize, s->hl, start);
+  row->hlspans = editorSyntaxToSpans(s->hl, row->rsize, &row->hl);
+}
+
+int editorSyntaxToColor(int hl)
+{
+  switch (hl)
+  {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_STRING:
+    return 35;
+  case HL_FUNCTION:
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_NUMBER:
+    return 31;
+  case HL_MATCH:
+    return 34;
+  default:
+    return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight()
+{
+  E.syntax = NULL;
+  if (E.filename == NULL)
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+  {
+    editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i])
+    {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
+      {
+        if (s->tables == NULL)
+          s->tables = editorSyntaxCompile(s);
+        E.syntax = s;
+
+        // Rows are highlighted again the next time they are drawn, or all at
+        // once across the worker pool for large files.
+        int filerow;
+        for (filerow = 0; filerow < E.numrows; filerow++)
+        {
+          editorRowAt(filerow)->stale = 1;
+        }
+        E.hlvalid = 0;
+        E.hlepoch++;
+        if (E.numrows >= WILO_HL_PARALLEL_ROWS && poolSize() > 1)
+          editorSyntaxParallel();
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** row table ***/
+
+// Rows are kept in a gap buffer: E.row holds E.rowcap slots, rows [0, E.rowgap)
+// sit at the front and the remaining rows at the back, so inserting or deleting
+// next to the previous edit only moves the gap a few slots.
+
+erow *editorRowAt(int at)
+{
+  if (at >= E.rowgap)
+    at += E.rowcap - E.numrows;
+  return &E.row[at];
+}
+
+int editorRowIndex(erow *row)
+{
+  int at = row - E.row;
+  if (at >= E.rowgap)
+    at -= E.rowcap - E.numrows;
+  return at;
+}
+
+void editorRowTableMoveGap(int at)
+{
+  int gaplen = E.rowcap - E.numrows;
+  if (at < E.rowgap)
+    memmove(&E.row[at + gaplen], &E.row[at], sizeof(erow) * (E.rowgap - at));
+  else if (at > E.rowgap)
+    memmove(&E.row[E.rowgap], &E.row[E.rowgap + gaplen], sizeof(erow) * (at - E.rowgap));
+  E.rowgap = at;
+}
+
+void editorRowTableReserve(int extra)
+{
+  if (E.numrows + extra <= E.rowcap)
+    return;
+
+  int newcap = E.rowcap ? E.rowcap : 64;
+  while (newcap < E.numrows + extra)
+    newcap *= 2;
+
+  erow *new = realloc(E.row, sizeof(erow) * newcap);
+  if (new == NULL)
+    die("realloc");
+  int tail = E.numrows - E.rowgap;
+  memmove(&new[newcap - tail], &new[E.rowcap - tail], sizeof(erow) * tail);
+  E.row = new;
+  E.rowcap = newcap;
+}
+
+/*** piece table ***/
+
+// Rows read from disk point into a read-only mapping of the file (E.pt.orig)
+// until they are edited. Normally an edited row is copied to the heap; in
+// piece table mode it is written to an append-only buffer instead, so no row
+// owns its bytes and text memory grows with the edits rather than the file
+// size. The row table still has an erow per line either way.
+// Append blocks are never moved or freed while rows point into them.
+
+#define WILO_ADD_BLOCK_SIZE (64 * 1024)
+
+char *pieceAlloc(size_t len)
+{
+  addBlock *b = E.pt.add;
+  if (b == NULL || b->cap - b->len < len)
+  {
+    b = malloc(sizeof(addBlock));
+    if (b == NULL)
+      die("malloc");
+    b->cap = len * 2 > WILO_ADD_BLOCK_SIZE ? len * 2 : WILO_ADD_BLOCK_SIZE;
+    b->data = malloc(b->cap);
+    if (b->data == NULL)
+      die("malloc");
+    b->len = 0;
+    b->next = E.pt.add;
+    E.pt.add = b;
+  }
+  char *p = &b->data[b->len];
+  b->len += len;
+  E.pt.addlen += len;
+  return p;
+}
+
+int pieceContains(char *s)
+{
+  if (E.pt.origlen && s >= E.pt.orig && s < E.pt.orig + E.pt.origlen)
+    return 1;
+  addBlock *b = E.pt.add;
+  return b && s >= b->data && s < b->data + b->len;
+}
+
+// Rows are null terminated while they sit at the end of the append buffer, so
+// the last row appended is the only one that may be edited in place.
+int pieceIsTail(erow *row)
+{
+  addBlock *b = E.pt.add;
+  return b && row->chars && row->chars >= b->data &&
+         row->chars + row->size + 1 == b->data + b->len;
+}
+
+void pieceRowReserve(erow *row, int size)
+{
+  addBlock *b = E.pt.add;
+  if (pieceIsTail(row) && (size_t)(row->chars - b->data) + size + 1 <= b->cap)
+  {
+    size_t newlen = (row->chars - b->data) + size + 1;
+    E.pt.addlen += newlen - b->len;
+    b->len = newlen;
+    return;
+  }
+  // Bytes a row was given in the append buffer are its own, so it can shrink
+  // there. Lines of the file are read-only and are copied like any growth.
+  if (row->chars && size <= row->size &&
+      !(row->chars >= E.pt.orig && row->chars < E.pt.orig + E.pt.origlen))
+    return;
+
+  char *p = pieceAlloc(size + 1);
+  if (row->size)
+    memcpy(p, row->chars, row->size);
+  p[row->size] = '\0';
+  row->chars = p;
+}
+
+void pieceFree()
+{
+  while (E.pt.add)
+  {
+    addBlock *b = E.pt.add;
+    E.pt.add = b->next;
+    free(b->data);
+    free(b);
+  }
+  E.pt.addlen = 0;
+
+  editorIndexCancel();
+  if (E.pt.origowned)
+    free(E.pt.orig);
+  else
+    unmapFile(E.pt.orig, E.pt.origlen);
+  E.pt.orig = NULL;
+  E.pt.origlen = 0;
+}
+
+/*** row operations ***/
+
+int editorRowCxtoRx(erow *row, int cx)
+{
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++)
+  {
+    if (row->chars[j] == '\t')
+      rx += (WILO_TAB_STOP - 1) - (rx % WILO_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++)
+  {
+    if (row->chars[cx] == '\t')
+      cur_rx += (WILO_TAB_STOP - 1) - (cur_rx % WILO_TAB_STOP);
+    cur_rx++;
+
+    if (cur_rx > rx)
+      return cx;
+  }
+  return cx;
+}
+
+int editorRowRenderCap(erow *row)
+{
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+  return row->size + tabs * (WILO_TAB_STOP - 1) + 1;
+}
+
+int editorRowExpandTabs(erow *row, char *render)
+{
+  int idx = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      render[idx++] = ' ';
+      while (idx % WILO_TAB_STOP != 0)
+        render[idx++] = ' ';
+    }
+    else
+    {
+      render[idx++] = row->chars[j];
+    }
+  }
+  render[idx] = '\0';
+  return idx;
+}
+
+void editorUpdateRow(erow *row, int start, hlScratch *s)
+{
+  free(row->render);
+  row->render = malloc(editorRowRenderCap(row));
+  row->rsize = editorRowExpandTabs(row, row->render);
+
+  editorUpdateSyntax(row, start, s);
+  row->stale = 0;
+}
+
+// Index of the first span that ends after render offset rx.
+int editorRowSpanAt(erow *row, int rx)
+{
+  int lo = 0, hi = row->hlspans;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (row->hl[mid].start + row->hl[mid].len <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Returns the comment state at the end of a row without keeping its render.
+int editorRowScanState(erow *row, int start, hlScratch *s)
+{
+  hlScratchReserve(s, editorRowRenderCap(row));
+  int rsize = editorRowExpandTabs(row, s->render);
+  return editorSyntaxHighlight(E.syntax, s->render, rsize, s->hl, start);
+}
+
+// Rows below E.hlvalid have hl_start and hl_open_comment resolved from the
+// row above. A row whose content and start state did not change is a
+// checkpoint: its stored end state is reused without scanning it again, so
+// once the state converges after an edit the walk only checks each row.
+// Returns 1 if the row at the watermark had to be scanned.
+int editorResolveNextRow()
+{
+  erow *row = editorRowAt(E.hlvalid);
+  int start = E.hlvalid > 0 ? editorRowAt(E.hlvalid - 1)->hl_open_comment : 0;
+  int scanned = 0;
+  if (row->stale || row->hl_start != start)
+  {
+    if (row->render)
+    {
+      editorUpdateRow(row, start, &E.scratch);
+    }
+    else
+    {
+      row->hl_open_comment = editorRowScanState(row, start, &E.scratch);
+      row->hl_start = start;
+      row->stale = 0;
+    }
+    scanned = 1;
+  }
+  E.hlvalid++;
+  return scanned;
+}
+
+void editorResolveSyntax(int at)
+{
+  if (E.syntax == NULL)
+  {
+    if (E.hlvalid < at)
+      E.hlvalid = at;
+    return;
+  }
+
+  while (E.hlvalid < at)
+    editorResolveNextRow();
+}
+
+// Whole-file highlighting split into chunks of rows across the worker pool.
+// The first pass highlights each chunk as if it started outside a comment,
+// then scans it again from inside one until that path meets the first.
+// Chaining the chunk end states gives every chunk its real start state, and
+// the second pass only fixes up the rows before the meeting point of chunks
+// that really start inside a comment.
+
+typedef struct hlParallel
+{
+  int numchunks;
+  int chunkrows;
+  int *start;
+  int *meet;
+  unsigned char *alt;
+  hlScratch *scratch;
+} hlParallel;
+
+void editorParallelScan(int chunk, int worker, void *arg)
+{
+  hlParallel *p = arg;
+  hlScratch *s = &p->scratch[worker];
+  int lo = chunk * p->chunkrows;
+  int hi = lo + p->chunkrows < E.numrows ? lo + p->chunkrows : E.numrows;
+
+  int state = 0;
+  for (int y = lo; y < hi; y++)
+  {
+    erow *row = editorRowAt(y);
+    if (row->render)
+    {
+      editorUpdateRow(row, state, s);
+    }
+    else
+    {
+      row->hl_start = state;
+      row->hl_open_comment = editorRowScanState(row, state, s);
+      row->stale = 0;
+    }
+    state = row->hl_open_comment;
+  }
+
+  int y = lo;
+  if (chunk > 0)
+  {
+    state = 1;
+    while (y < hi && state != editorRowAt(y)->hl_start)
+    {
+      state = editorRowScanState(editorRowAt(y), state, s);
+      p->alt[y++] = state;
+    }
+  }
+  p->meet[chunk] = y;
+}
+
+void editorParallelHighlight(int chunk, int worker, void *arg)
+{
+  hlParallel *p = arg;
+  hlScratch *s = &p->scratch[worker];
+  int lo = chunk * p->chunkrows;
+
+  if (!p->start[chunk])
+    return;
+  for (int y = lo; y < p->meet[chunk]; y++)
+  {
+    erow *row = editorRowAt(y);
+    int start = y > lo ? p->alt[y - 1] : 1;
+    if (row->render)
+      editorUpdateRow(row, start, s);
+    row->hl_start = start;
+    row->hl_open_comment = p->alt[y];
+  }
+}
+
+void editorSyntaxParallel()
+{
+  hlParallel p;
+  int workers = poolSize();
+  p.chunkrows = (E.numrows + workers * 4 - 1) / (workers * 4);
+  if (p.chunkrows < WILO_HL_CHUNK_ROWS)
+    p.chunkrows = WILO_HL_CHUNK_ROWS;
+  p.numchunks = (E.numrows + p.chunkrows - 1) / p.chunkrows;
+  p.start = malloc(sizeof(int) * p.numchunks);
+  p.meet = malloc(sizeof(int) * p.numchunks);
+  p.alt = malloc(E.numrows);
+  p.scratch = calloc(workers, sizeof(hlScratch));
+
+  poolRun(p.numchunks, editorParallelScan, &p);
+
+  p.start[0] = 0;
+  for (int c = 1; c < p.numchunks; c++)
+  {
+    int last = c * p.chunkrows - 1;
+    if (p.start[c - 1] && p.meet[c - 1] > last)
+      p.start[c] = p.alt[last];
+    else
+      p.start[c] = editorRowAt(last)->hl_open_comment;
+  }
+
+  poolRun(p.numchunks, editorParallelHighlight, &p);
+  E.hlvalid = E.numrows;
+
+  for (int i = 0; i < workers; i++)
+  {
+    free(p.scratch[i].render);
+    free(p.scratch[i].hl);
+  }
+  free(p.scratch);
+  free(p.alt);
+  free(p.meet);
+  free(p.start);
+}
+
+// Builds render and hl for a row from the state stored in the row above,
+// without resolving the rows in between. Used for drawing far below the
+// watermark, where the background highlighter corrects it later.
+erow *editorRowRenderDraft(int at)
+{
+  erow *row = editorRowAt(at);
+  int start = (E.syntax && at > 0) ? editorRowAt(at - 1)->hl_open_comment : 0;
+  if (row->render == NULL || row->stale || row->hl_start != start)
+    editorUpdateRow(row, start, &E.scratch);
+  return row;
+}
+
+// Builds render and hl for a row the first time it is needed or after it
+// changed.
+erow *editorRowRender(int at)
+{
+  editorResolveSyntax(at);
+  return editorRowRenderDraft(at);
+}
+
+void editorRowChanged(erow *row)
+{
+  row->stale = 1;
+  row->version = ++E.rowversion;
+  indexRowChanged(row);
+  int at = editorRowIndex(row);
+  if (at < E.hlvalid)
+    E.hlvalid = at;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+  if (at < 0 || at > E.numrows)
+    return;
+
+  editorRowTableReserve(1);
+  editorRowTableMoveGap(at);
+  erow *row = &E.row[at];
+  E.rowgap++;
+  E.numrows++;
+
+  row->size = len;
+  if (len == 0)
+  {
+    row->chars = NULL;
+  }
+  else if (pieceContains(s))
+  {
+    row->chars = s;
+  }
+  else
+  {
+    row->chars = E.piecetable ? pieceAlloc(len + 1) : malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+  }
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hlspans = 0;
+  row->hl_start = 0;
+  row->hl_open_comment = 0;
+  row->stale = 1;
+  row->version = ++E.rowversion;
+  indexRowInserted(row);
+  if (at < E.hlvalid)
+    E.hlvalid = at;
+
+  E.dirty++;
+}
+
+int editorRowOwnsChars(erow *row)
+{
+  return !E.piecetable && row->chars && !pieceContains(row->chars);
+}
+
+void editorFreeRow(erow *row)
+{
+  free(row->render);
+  if (editorRowOwnsChars(row))
+    free(row->chars);
+  free(row->hl);
+}
+
+// Makes row->chars writable with room for size bytes and a terminator.
+void editorRowReserve(erow *row, int size)
+{
+  if (E.piecetable)
+  {
+    pieceRowReserve(row, size);
+  }
+  else if (editorRowOwnsChars(row) || row->chars == NULL)
+  {
+    row->chars = realloc(row->chars, size + 1);
+  }
+  else
+  {
+    char *chars = malloc(size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+  }
+}
+
+void editorDelRow(int at)
+{
+  if (at < 0 || at >= E.numrows)
+    return;
+  editorRowTableMoveGap(at + 1);
+  editorFreeRow(&E.row[at]);
+  E.rowgap--;
+  indexRowsMoved();
+  if (at < E.hlvalid)
+    E.hlvalid = at;
+  E.numrows--;
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
+{
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editorRowReserve(row, row->size + 1);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorRowChanged(row);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+  editorRowReserve(row, row->size + len);
+  if (len)
+    memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorRowChanged(row);
+  E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at)
+{
+  if (at < 0 || at >= row->size)
+    return;
+
+  editorRowReserve(row, row->size);
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  row->size--;
+  editorRowChanged(row);
+  E.dirty++;
+}
+
+/*** background highlighting ***/
+
+// Rows past the watermark are resolved on a highlighter thread. The main
+// thread hands it a batch of row snapshots (a copy of the text, the version
+// and the stored states), and applies the end states it returns one row at a
+// time at the watermark, as long as the row's version and start state still
+// match the snapshot. Anything else is discarded and counted.
+
+typedef struct hlJobRow
+{
+  unsigned int version;
+  int offset;
+  int size;
+  int stale;
+  int hl_start;
+  int hl_open_comment;
+  int end;
+} hlJobRow;
+
+typedef struct hlJob
+{
+  editorSyntax *syntax;
+  unsigned int epoch;
+  int first;
+  int count;
+  int start;
+  hlJobRow *rows;
+  char *chars;
+} hlJob;
+
+typedef struct hlThread
+{
+  int running;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+  hlJob *pending;
+  hlJob *busy;
+  hlJob *done;
+} hlThread;
+
+hlThread hlbg;
+
+void hlJobFree(hlJob *job)
+{
+  free(job->rows);
+  free(job->chars);
+  free(job);
+}
+
+void editorHighlightJob(hlJob *job, hlScratch *s)
+{
+  int state = job->start;
+  for (int i = 0; i < job->count; i++)
+  {
+    hlJobRow *jr = &job->rows[i];
+    if (!jr->stale && jr->hl_start == state)
+    {
+      jr->end = jr->hl_open_comment;
+    }
+    else
+    {
+      erow row;
+      row.size = jr->size;
+      row.chars = &job->chars[jr->offset];
+      hlScratchReserve(s, editorRowRenderCap(&row));
+      int rsize = editorRowExpandTabs(&row, s->render);
+      jr->end = editorSyntaxHighlight(job->syntax, s->render, rsize, s->hl, state);
+    }
+    state = jr->end;
+  }
+}
+
+DWORD WINAPI editorHighlightThread(void *param)
+{
+  hlScratch s = {NULL, NULL, 0};
+  (void)param;
+
+  EnterCriticalSection(&hlbg.lock);
+  for (;;)
+  {
+    while (hlbg.pending == NULL)
+      SleepConditionVariableCS(&hlbg.wake, &hlbg.lock, INFINITE);
+    hlbg.busy = hlbg.pending;
+    hlbg.pending = NULL;
+    LeaveCriticalSection(&hlbg.lock);
+
+    editorHighlightJob(hlbg.busy, &s);
+
+    EnterCriticalSection(&hlbg.lock);
+    hlbg.done = hlbg.busy;
+    hlbg.busy = NULL;
+    inputWake();
+  }
+  return 0;
+}
+
+// Snapshots the rows from the watermark on and hands them to the thread.
+void editorHighlightPost()
+{
+  if (!hlbg.running)
+  {
+    InitializeCriticalSection(&hlbg.lock);
+    InitializeConditionVariable(&hlbg.wake);
+    inputWakeInit();
+    HANDLE thread = CreateThread(NULL, 0, editorHighlightThread, NULL, 0, NULL);
+    if (thread == NULL)
+      die("CreateThread");
+    CloseHandle(thread);
+    hlbg.running = 1;
+  }
+
+  hlJob *job = malloc(sizeof(hlJob));
+  job->syntax = E.syntax;
+  job->epoch = E.hlepoch;
+  job->first = E.hlvalid;
+  job->count = E.numrows - E.hlvalid;
+  if (job->count > WILO_HL_BATCH_ROWS)
+    job->count = WILO_HL_BATCH_ROWS;
+  job->start = E.hlvalid > 0 ? editorRowAt(E.hlvalid - 1)->hl_open_comment : 0;
+  job->rows = malloc(sizeof(hlJobRow) * job->count);
+
+  size_t len = 0;
+  for (int i = 0; i < job->count; i++)
+    len += editorRowAt(job->first + i)->size;
+  job->chars = malloc(len + 1);
+  len = 0;
+  for (int i = 0; i < job->count; i++)
+  {
+    erow *row = editorRowAt(job->first + i);
+    hlJobRow *jr = &job->rows[i];
+    jr->version = row->version;
+    jr->offset = len;
+    jr->size = row->size;
+    jr->stale = row->stale;
+    jr->hl_start = row->hl_start;
+    jr->hl_open_comment = row->hl_open_comment;
+    if (row->size)
+      memcpy(&job->chars[len], row->chars, row->size);
+    len += row->size;
+  }
+
+  EnterCriticalSection(&hlbg.lock);
+  hlbg.pending = job;
+  WakeConditionVariable(&hlbg.wake);
+  LeaveCriticalSection(&hlbg.lock);
+}
+
+void editorHighlightApply(hlJob *job)
+{
+  int i = 0;
+  if (job->epoch == E.hlepoch)
+  {
+    for (; i < job->count; i++)
+    {
+      int at = job->first + i;
+      if (at < E.hlvalid)
+        continue;
+      if (at > E.hlvalid || at >= E.numrows)
+        break;
+
+      erow *row = editorRowAt(at);
+      int start = at > 0 ? editorRowAt(at - 1)->hl_open_comment : 0;
+      hlJobRow *jr = &job->rows[i];
+      if (row->version != jr->version || start != (i > 0 ? job->rows[i - 1].end : job->start))
+        break;
+
+      if (row->render && (row->stale || row->hl_start != start))
+      {
+        // Drawn with a draft state; it is rebuilt on the next frame.
+        free(row->render);
+        row->render = NULL;
+        if (at >= E.rowoff && at < E.rowoff + E.screenrows)
+          E.redraw = 1;
+      }
+      row->hl_start = start;
+      row->hl_open_comment = jr->end;
+      row->stale = 0;
+      E.hlvalid++;
+    }
+  }
+  E.hldiscarded += job->count - i;
+}
+
+// Called while the editor waits for input: applies finished background
+// results and posts the next batch. Returns 1 while rows are left.
+int editorSyntaxIdle()
+{
+  if (E.syntax == NULL)
+  {
+    E.hlvalid = E.numrows;
+    return 0;
+  }
+
+  // Rows whose content and start state did not change need no scan.
+  int skipped = 0;
+  while (E.hlvalid < E.numrows && skipped < WILO_HL_BATCH_ROWS)
+  {
+    erow *row = editorRowAt(E.hlvalid);
+    int start = E.hlvalid > 0 ? editorRowAt(E.hlvalid - 1)->hl_open_comment : 0;
+    if (row->stale || row->hl_start != start)
+      break;
+    E.hlvalid++;
+    skipped++;
+  }
+
+  hlJob *done = NULL;
+  int idle = 1;
+  if (hlbg.running)
+  {
+    EnterCriticalSection(&hlbg.lock);
+    done = hlbg.done;
+    hlbg.done = NULL;
+    idle = hlbg.pending == NULL && hlbg.busy == NULL;
+    LeaveCriticalSection(&hlbg.lock);
+  }
+  if (done)
+  {
+    editorHighlightApply(done);
+    hlJobFree(done);
+  }
+  if (idle && E.hlvalid < E.numrows)
+    editorHighlightPost();
+  return E.hlvalid < E.numrows;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c)
+{
+  if (E.cy == E.numrows)
+  {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+}
+
+void editorDelChar()
+{
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0)
+  {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  }
+  else
+  {
+    erow *prev = editorRowAt(E.cy - 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+// Inserts a block of text at the cursor. The rows in between are created
+// directly and the rows it splits are changed once, rather than once per
+// character.
+void editorInsertText(char *s, size_t len)
+{
+  // A line break past the last row only ends the row it creates.
+  while (len && E.cy == E.numrows && *s == '\n')
+  {
+    editorInsertRow(E.numrows, "", 0);
+    E.cy++;
+    E.cx = 0;
+    E.dirty++;
+    s++;
+    len--;
+  }
+  if (len == 0)
+    return;
+  if (E.cy == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+
+  erow *row = editorRowAt(E.cy);
+  char *end = s + len;
+  char *nl = memchr(s, '\n', len);
+  if (nl == NULL)
+  {
+    editorRowReserve(row, row->size + len);
+    memmove(&row->chars[E.cx + len], &row->chars[E.cx], row->size - E.cx + 1);
+    memcpy(&row->chars[E.cx], s, len);
+    row->size += len;
+    E.cx += len;
+    editorRowChanged(row);
+    E.dirty++;
+    return;
+  }
+
+  int lines = 0;
+  char *last = s;
+  for (char *p = nl; p; p = memchr(p + 1, '\n', end - p - 1))
+  {
+    lines++;
+    last = p + 1;
+  }
+  int taillen = row->size - E.cx;
+  editorRowTableReserve(lines);
+
+  // The last line takes over the part of the row after the cursor.
+  int lastlen = end - last;
+  editorInsertRow(E.cy + 1, last, lastlen);
+  row = editorRowAt(E.cy);
+  erow *tail = editorRowAt(E.cy + 1);
+  if (taillen)
+  {
+    editorRowReserve(tail, lastlen + taillen);
+    memcpy(&tail->chars[lastlen], &row->chars[E.cx], taillen);
+    tail->size = lastlen + taillen;
+    tail->chars[tail->size] = '\0';
+  }
+
+  int firstlen = nl - s;
+  row->size = E.cx;
+  editorRowReserve(row, E.cx + firstlen);
+  memcpy(&row->chars[E.cx], s, firstlen);
+  row->size = E.cx + firstlen;
+  row->chars[row->size] = '\0';
+  editorRowChanged(row);
+
+  int at = E.cy + 1;
+  for (char *p = nl + 1; p < last; at++)
+  {
+    char *q = memchr(p, '\n', last - p);
+    editorInsertRow(at, p, q - p);
+    p = q + 1;
+  }
+
+  E.cy += lines;
+  E.cx = lastlen;
+  E.dirty++;
+}
+
+// Reads a bracketed paste up to PASTE_END and inserts it in one go.
+// Terminals send line breaks in a paste as CR or CR LF. If PASTE_END is lost,
+// the paste ends when no input comes for WILO_PASTE_MS.
+void editorPaste()
+{
+  size_t cap = 4096, len = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die("malloc");
+
+  int cr = 0;
+  while (1)
+  {
+    if (!inputPending(WILO_PASTE_MS))
+      break;
+    int repeat;
+    int c = editorReadKeyRepeat(&repeat, 0);
+    if (c == PASTE_END)
+      break;
+    // Escape sequences in the pasted text were decoded as keys; drop them.
+    if (c >= ARROW_LEFT)
+      continue;
+    if (len + repeat > cap)
+    {
+      cap = (len + repeat) * 2;
+      buf = realloc(buf, cap);
+    }
+    while (repeat--)
+    {
+      if (c == '\n' && cr)
+      {
+        cr = 0;
+        continue;
+      }
+      cr = c == '\r';
+      buf[len++] = cr ? '\n' : c;
+    }
+  }
+
+  editorInsertText(buf, len);
+  free(buf);
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(size_t *buflen)
+{
+  size_t totlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++)
+  {
+    totlen += editorRowAt(j)->size + 1;
   }
   *buflen = totlen;
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++)
+  char *buf = malloc(totlen);
+  if (buf == NULL)
+    return NULL;
+  char *p = buf;
+  for (j = 0; j < E.numrows; j++)
+  {
+    erow *row = editorRowAt(j);
+    if (row->size)
+      memcpy(p, row->chars, row->size);
+    p += row->size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+// Points every row at its line in buf, which must hold the rows joined by
+// newlines, and drops the previous file buffers.
+void editorRebaseRows(char *buf, size_t len, int owned)
+{
+  char *p = buf;
+  for (int j = 0; j < E.numrows; j++)
+  {
+    erow *row = editorRowAt(j);
+    if (editorRowOwnsChars(row))
+      free(row->chars);
+    row->chars = row->size ? p : NULL;
+    p += row->size + 1;
+  }
+
+  pieceFree();
+  E.pt.orig = buf;
+  E.pt.origlen = len;
+  E.pt.origowned = owned;
+}
+
+void editorLoadLine(char *line, char *nl)
+{
+  size_t linelen = nl - line;
+  while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+    linelen--;
+  editorInsertRow(E.numrows, line, linelen);
+}
+
+void editorLoadLines(char *buf, size_t len)
+{
+  char *line = buf;
+  size_t i = 0;
+
+#ifdef WILO_SSE2
+  // Compare 32 bytes at a time against '\n' and walk the set bits of the mask.
+  __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 32 <= len; i += 32)
+  {
+    __m128i a = _mm_loadu_si128((__m128i *)&buf[i]);
+    __m128i b = _mm_loadu_si128((__m128i *)&buf[i + 16]);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)) |
+                        ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl)) << 16);
+    while (mask)
+    {
+      char *end = &buf[i + ctz32(mask)];
+      editorLoadLine(line, end);
+      line = end + 1;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i < len; i++)
+  {
+    if (buf[i] == '\n')
+    {
+      editorLoadLine(line, &buf[i]);
+      line = &buf[i + 1];
+    }
+  }
+  if (line < buf + len)
+    editorLoadLine(line, buf + len);
+}
+
+// Rows point into the mapping until they are first edited.
+int editorOpenMapped(char *filename)
+{
+  size_t len;
+  char *buf = mapFile(filename, &len);
+  if (buf == NULL)
+    return -1;
+
+  pieceFree();
+  E.pt.orig = buf;
+  E.pt.origlen = len;
+  E.pt.origowned = 0;
+  editorLoadLines(buf, len);
+  return 0;
+}
+
+void editorOpenStream(char *filename)
+{
+  FILE *fp = NULL;
+  fopen_s(&fp, filename, "r");
+  if (!fp)
+    die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  size_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != (size_t)-1)
+  {
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+}
+
+void editorOpen(char *filename)
+{
+  free(E.filename);
+  E.filename = _strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  int first = E.numrows;
+  int mapped = editorOpenMapped(filename) == 0;
+  if (!mapped)
+  {
+    if (E.piecetable)
+      die("mapFile");
+    editorOpenStream(filename);
+  }
+  editorIndexOpen(first, mapped);
+  E.dirty = 0;
+}
+
+void editorSave()
+{
+  if (E.filename == NULL)
+  {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL)
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  size_t len;
+  char *buf = editorRowsToString(&len);
+  if (buf == NULL)
+  {
+    editorSetStatusMessage("Can't save! Out of memory");
+    return;
+  }
+
+  // Rows must stop pointing into the old file before it gets overwritten.
+  editorRebaseRows(buf, len, 1);
+
+#if 0
+  FILE *fp = NULL;
+  fopen_s(&fp, E.filename, "w");
+  fprintf_s(fp, buf, len);
+  fclose(fp);
+  free(buf);
+#else
+  if (writeFile(E.filename, buf, len) == len)
+  {
+    editorSetStatusMessage("%zu bytes written to disk", len);
+    E.dirty = 0;
+
+    size_t maplen;
+    char *map = mapFile(E.filename, &maplen);
+    if (map && maplen == len)
+      editorRebaseRows(map, maplen, 0);
+    else if (map)
+      unmapFile(map, maplen);
+    return;
+  }
+  char msg[1024];
+  int code = GetLastErrorAsString(msg, sizeof(msg));
+  if (code == 0)
+    strcpy_s(msg, 1024, "Unknown error");
+  editorSetStatusMessage("Can't save! I/O error: %s", msg);
+#endif
+}
+
+/*** regular expressions ***/
+
+// Patterns for the find prompt. A query is parsed into a tree and compiled
+// twice into a Thompson NFA: forward, and reversed behind a loop over any
+// byte so that a match can start anywhere. Both run as DFAs that are built
+// lazily, a state per set of NFA states the first time a byte leads to it,
+// so matching never backtracks and costs a table lookup per byte. Each
+// worker has its own caches, and a cache that reaches WILO_REGEX_STATES
+// states is emptied and refilled, which bounds memory on patterns whose DFA
+// would blow up. A cache refilled after fewer than
+// WILO_REGEX_MIN_BYTES_PER_STATE bytes per state spends its time building
+// states, so from then on that scan runs the NFA directly, stepping the set
+// of NFA states a byte at a time. That bounds the time per byte by the size
+// of the program, whatever the pattern.
+//
+// Matches are leftmost-longest. A row is scanned backwards once to mark the
+// offsets where a match starts; from each start the forward DFA runs until
+// it dies, and its last accepting offset is the end.
+//
+// Supported: literals, ., [...] with ranges and ^, \d \w \s and \D \W \S,
+// other escapes as literals, ^ $, (...), |, * + ? and {m} {m,} {m,n}.
+
+enum regexOp
+{
+  RX_CLASS = 0,
+  RX_EMPTY,
+  RX_CAT,
+  RX_ALT,
+  RX_REPEAT,
+  RX_BOL,
+  RX_EOL,
+};
+
+enum regexInstOp
+{
+  RI_BYTE = 0,
+  RI_SPLIT,
+  RI_BEGIN,
+  RI_END,
+  RI_MATCH,
+};
+
+// Where the scan is, for the assertions an NFA state can pass.
+#define RX_AT_BEGIN (1 << 0)
+#define RX_AT_END (1 << 1)
+
+// A DFA state accepts in the middle of the text, or only at its end.
+#define RX_ACCEPT (1 << 0)
+#define RX_ACCEPT_AT_END (1 << 1)
+
+typedef struct regexNode
+{
+  int op;
+  // The class of RX_CLASS, the operands of the others.
+  int left;
+  int right;
+  int min;
+  int max;
+} regexNode;
+
+// RI_BYTE reads a byte of class out1; RI_SPLIT goes to out and out1;
+// RI_BEGIN and RI_END hold at the start and end of the scan.
+typedef struct regexInst
+{
+  int op;
+  int out;
+  int out1;
+} regexInst;
+
+typedef struct regexProg
+{
+  regexInst *insts;
+  int numinsts;
+  int start;
+  int match;
+} regexProg;
+
+typedef struct regexCache
+{
+  regexProg *prog;
+  int numstates;
+  int statecap;
+  // Next state per state and byte class, -1 until first taken. State 0
+  // is the dead state.
+  int *next;
+  unsigned char *accept;
+  int *setoff;
+  int *setlen;
+  int *sets;
+  int setsused;
+  int setscap;
+  int *table;
+  int start[4];
+  int *stack;
+  int *work;
+  unsigned int *mark;
+  unsigned int gen;
+  // Offsets of the row where a match starts, on the reverse cache, and how
+  // many bytes the forward scans from them have read. Past a budget the
+  // longest match from each offset is found at once, in ends.
+  unsigned char *starts;
+  int startscap;
+  long rowscanned;
+  int *ends;
+  int hasends;
+  unsigned long flushes;
+  // Bytes scanned, and the count at the last flush. Set once the cache
+  // thrashes, the scan runs the NFA with work and list as its sets.
+  unsigned long scanned;
+  unsigned long flushedat;
+  int nfa;
+  int *list;
+  // On the reverse cache, where the threads in work and list started, for
+  // regexMarkEnds.
+  int *origin;
+  int *listorigin;
+} regexCache;
+
+typedef struct regex
+{
+  regexNode *nodes;
+  int numnodes;
+  int nodecap;
+  unsigned char (*classes)[32];
+  int numclasses;
+  int classcap;
+  // Bytes no class tells apart share a column of the DFA tables.
+  unsigned char bytemap[256];
+  unsigned char classbyte[256];
+  int numbyteclasses;
+  regexProg fwd;
+  regexProg rev;
+  // Forward and reverse cache of each worker.
+  regexCache *caches;
+} regex;
+
+typedef struct regexParser
+{
+  regex *re;
+  const char *s;
+  int len;
+  int pos;
+  int icase;
+  const char *error;
+} regexParser;
+
+int regexNewNode(regexParser *ps, int op, int left, int right)
+{
+  regex *re = ps->re;
+  if (re->numnodes == re->nodecap)
+  {
+    re->nodecap = re->nodecap ? re->nodecap * 2 : 16;
+    re->nodes = realloc(re->nodes, sizeof(regexNode) * re->nodecap);
+  }
+  regexNode *n = &re->nodes[re->numnodes];
+  n->op = op;
+  n->left = left;
+  n->right = right;
+  n->min = n->max = 0;
+  return re->numnodes++;
+}
+
+int regexNewClass(regexParser *ps)
+{
+  regex *re = ps->re;
+  if (re->numclasses == re->classcap)
+  {
+    re->classcap = re->classcap ? re->classcap * 2 : 16;
+    re->classes = realloc(re->classes, sizeof(re->classes[0]) * re->classcap);
+  }
+  memset(re->classes[re->numclasses], 0, sizeof(re->classes[0]));
+  return re->numclasses++;
+}
+
+void regexClassAdd(regexParser *ps, int cls, int c)
+{
+  unsigned char *set = ps->re->classes[cls];
+  set[c >> 3] |= 1 << (c & 7);
+  if (ps->icase && (c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+  {
+    c ^= 0x20;
+    set[c >> 3] |= 1 << (c & 7);
+  }
+}
+
+// Adds the bytes of \d, \w, \s or their uppercase negations. Returns 0 for
+// any other escape.
+int regexClassEscape(regexParser *ps, int cls, int e)
+{
+  int kind = e | 0x20;
+  if (kind != 'd' && kind != 'w' && kind != 's')
+    return 0;
+  for (int c = 0; c < 256; c++)
+  {
+    int digit = c >= '0' && c <= '9';
+    int in = kind == 'd'   ? digit
+             : kind == 'w' ? digit || c == '_' || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+                           : c == ' ' || (c >= '\t' && c <= '\r');
+    if (in != (e != kind))
+      ps->re->classes[cls][c >> 3] |= 1 << (c & 7);
+  }
+  return 1;
+}
+
+int regexEscapeByte(int e)
+{
+  switch (e)
+  {
+  case 't':
+    return '\t';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  default:
+    return e;
+  }
+}
+
+int regexParseClass(regexParser *ps)
+{
+  int cls = regexNewClass(ps);
+  int negate = ps->pos < ps->len && ps->s[ps->pos] == '^';
+  if (negate)
+    ps->pos++;
+
+  int first = 1;
+  while (ps->pos < ps->len && (first || ps->s[ps->pos] != ']'))
+  {
+    first = 0;
+    int c = (unsigned char)ps->s[ps->pos++];
+    if (c == '\\' && ps->pos < ps->len)
+    {
+      int e = (unsigned char)ps->s[ps->pos++];
+      if (regexClassEscape(ps, cls, e))
+        continue;
+      c = regexEscapeByte(e);
+    }
+    int hi = c;
+    if (ps->pos + 1 < ps->len && ps->s[ps->pos] == '-' && ps->s[ps->pos + 1] != ']')
+    {
+      hi = (unsigned char)ps->s[ps->pos + 1];
+      ps->pos += 2;
+      if (hi == '\\' && ps->pos < ps->len)
+        hi = regexEscapeByte((unsigned char)ps->s[ps->pos++]);
+      if (hi < c)
+      {
+        ps->error = "bad range";
+        return cls;
+      }
+    }
+    for (; c <= hi; c++)
+      regexClassAdd(ps, cls, c);
+  }
+  if (ps->pos >= ps->len)
+  {
+    ps->error = "missing ]";
+    return cls;
+  }
+  ps->pos++;
+
+  if (negate)
+  {
+    for (int i = 0; i < 32; i++)
+      ps->re->classes[cls][i] ^= 0xff;
+  }
+  return cls;
+}
+
+int regexParseAlt(regexParser *ps);
+
+int regexParseAtom(regexParser *ps)
+{
+  int c = (unsigned char)ps->s[ps->pos++];
+  int cls;
+  switch (c)
+  {
+  case '(':
+  {
+    int n = regexParseAlt(ps);
+    if (ps->pos >= ps->len || ps->s[ps->pos] != ')')
+    {
+      if (!ps->error)
+        ps->error = "missing )";
+      return n;
+    }
+    ps->pos++;
+    return n;
+  }
+  case '^':
+    return regexNewNode(ps, RX_BOL, 0, 0);
+  case '$':
+    return regexNewNode(ps, RX_EOL, 0, 0);
+  case '*':
+  case '+':
+  case '?':
+    ps->error = "nothing to repeat";
+    return regexNewNode(ps, RX_EMPTY, 0, 0);
+  case '.':
+    cls = regexNewClass(ps);
+    memset(ps->re->classes[cls], 0xff, sizeof(ps->re->classes[0]));
+    break;
+  case '[':
+    cls = regexParseClass(ps);
+    break;
+  case '\\':
+    if (ps->pos >= ps->len)
+    {
+      ps->error = "trailing \\";
+      return regexNewNode(ps, RX_EMPTY, 0, 0);
+    }
+    c = (unsigned char)ps->s[ps->pos++];
+    cls = regexNewClass(ps);
+    if (!regexClassEscape(ps, cls, c))
+      regexClassAdd(ps, cls, regexEscapeByte(c));
+    break;
+  default:
+    cls = regexNewClass(ps);
+    regexClassAdd(ps, cls, c);
+    break;
+  }
+  return regexNewNode(ps, RX_CLASS, cls, 0);
+}
+
+int regexParseNumber(regexParser *ps)
+{
+  int n = -1;
+  while (ps->pos < ps->len && ps->s[ps->pos] >= '0' && ps->s[ps->pos] <= '9')
+  {
+    n = (n < 0 ? 0 : n * 10) + ps->s[ps->pos++] - '0';
+    if (n > WILO_REGEX_MAX_REPEAT)
+      n = WILO_REGEX_MAX_REPEAT + 1;
+  }
+  return n;
+}
+
+// Reads {m}, {m,} or {m,n}. Anything else is left alone and parsed as a
+// literal '{'.
+int regexParseCount(regexParser *ps, int *min, int *max)
+{
+  int start = ps->pos;
+  ps->pos++;
+  *min = regexParseNumber(ps);
+  *max = *min;
+  if (*min >= 0 && ps->pos < ps->len && ps->s[ps->pos] == ',')
+  {
+    ps->pos++;
+    *max = regexParseNumber(ps);
+  }
+  if (*min < 0 || ps->pos >= ps->len || ps->s[ps->pos] != '}')
+  {
+    ps->pos = start;
+    return 0;
+  }
+  ps->pos++;
+  return 1;
+}
+
+int regexParseRepeat(regexParser *ps)
+{
+  int n = regexParseAtom(ps);
+  while (!ps->error && ps->pos < ps->len)
+  {
+    int c = ps->s[ps->pos];
+    int min, max;
+    if (c == '*' || c == '+' || c == '?')
+    {
+      min = c == '+';
+      max = c == '?' ? 1 : -1;
+      ps->pos++;
+    }
+    else if (c != '{' || !regexParseCount(ps, &min, &max))
+    {
+      break;
+    }
+
+    if (min > WILO_REGEX_MAX_REPEAT || max > WILO_REGEX_MAX_REPEAT || (max >= 0 && max < min))
+    {
+      ps->error = "bad count";
+      break;
+    }
+    n = regexNewNode(ps, RX_REPEAT, n, 0);
+    ps->re->nodes[n].min = min;
+    ps->re->nodes[n].max = max;
+  }
+  return n;
+}
+
+int regexParseCat(regexParser *ps)
+{
+  int n = -1;
+  while (!ps->error && ps->pos < ps->len && ps->s[ps->pos] != '|' && ps->s[ps->pos] != ')')
+  {
+    int r = regexParseRepeat(ps);
+    n = n < 0 ? r : regexNewNode(ps, RX_CAT, n, r);
+  }
+  return n < 0 ? regexNewNode(ps, RX_EMPTY, 0, 0) : n;
+}
+
+int regexParseAlt(regexParser *ps)
+{
+  int n = regexParseCat(ps);
+  while (!ps->error && ps->pos < ps->len && ps->s[ps->pos] == '|')
+  {
+    ps->pos++;
+    int r = regexParseCat(ps);
+    // a|b is compiled as [ab], which steps one NFA state instead of three.
+    regexNode *left = &ps->re->nodes[n], *right = &ps->re->nodes[r];
+    if (left->op == RX_CLASS && right->op == RX_CLASS)
+    {
+      for (int i = 0; i < 32; i++)
+        ps->re->classes[left->left][i] |= ps->re->classes[right->left][i];
+      continue;
+    }
+    n = regexNewNode(ps, RX_ALT, n, r);
+  }
+  return n;
+}
+
+int regexEmit(regexProg *prog, int op, int out, int out1)
+{
+  if (prog->numinsts % 64 == 0)
+    prog->insts = realloc(prog->insts, sizeof(regexInst) * (prog->numinsts + 64));
+  regexInst *in = &prog->insts[prog->numinsts];
+  in->op = op;
+  in->out = out;
+  in->out1 = out1;
+  return prog->numinsts++;
+}
+
+// Emits node n in front of next and returns its entry. Reversed, it matches
+// the bytes of n from last to first.
+int regexCompileNode(regex *re, regexProg *prog, int n, int next, int reverse)
+{
+  if (prog->numinsts > WILO_REGEX_MAX_INSTS)
+    return next;
+
+  regexNode *node = &re->nodes[n];
+  switch (node->op)
+  {
+  case RX_CLASS:
+    return regexEmit(prog, RI_BYTE, next, node->left);
+  case RX_CAT:
+    if (reverse)
+      return regexCompileNode(re, prog, node->right, regexCompileNode(re, prog, node->left, next, 1), 1);
+    return regexCompileNode(re, prog, node->left, regexCompileNode(re, prog, node->right, next, 0), 0);
+  case RX_ALT:
+  {
+    int a = regexCompileNode(re, prog, node->left, next, reverse);
+    int b = regexCompileNode(re, prog, node->right, next, reverse);
+    return regexEmit(prog, RI_SPLIT, a, b);
+  }
+  case RX_BOL:
+    return regexEmit(prog, reverse ? RI_END : RI_BEGIN, next, 0);
+  case RX_EOL:
+    return regexEmit(prog, reverse ? RI_BEGIN : RI_END, next, 0);
+  case RX_REPEAT:
+  {
+    // x{2,4} is xx(x(x)?)? and x{2,} is xxx*.
+    int cur = next;
+    if (node->max < 0)
+    {
+      int loop = regexEmit(prog, RI_SPLIT, 0, next);
+      int body = regexCompileNode(re, prog, node->left, loop, reverse);
+      prog->insts[loop].out = body;
+      cur = loop;
+    }
+    for (int i = node->min; i < node->max; i++)
+    {
+      int body = regexCompileNode(re, prog, node->left, cur, reverse);
+      cur = regexEmit(prog, RI_SPLIT, body, next);
+    }
+    for (int i = 0; i < node->min; i++)
+      cur = regexCompileNode(re, prog, node->left, cur, reverse);
+    return cur;
+  }
+  default:
+    return next;
+  }
+}
+
+// Splits the bytes into the fewest classes that every class of the pattern
+// either holds or leaves out whole.
+void regexByteClasses(regex *re)
+{
+  int n = 1;
+  memset(re->bytemap, 0, sizeof(re->bytemap));
+  for (int k = 0; k < re->numclasses; k++)
+  {
+    int remap[512];
+    memset(remap, 0xff, sizeof(remap));
+    int m = 0;
+    for (int c = 0; c < 256; c++)
+    {
+      int key = re->bytemap[c] * 2 + ((re->classes[k][c >> 3] >> (c & 7)) & 1);
+      if (remap[key] < 0)
+        remap[key] = m++;
+      re->bytemap[c] = remap[key];
+    }
+    n = m;
+  }
+  re->numbyteclasses = n;
+  for (int c = 255; c >= 0; c--)
+    re->classbyte[re->bytemap[c]] = c;
+}
+
+void regexFree(regex *re)
+{
+  if (re == NULL)
+    return;
+  if (re->caches)
+  {
+    for (int i = 0; i < 2 * WILO_MAX_WORKERS; i++)
+    {
+      regexCache *c = &re->caches[i];
+      free(c->next);
+      free(c->accept);
+      free(c->setoff);
+      free(c->setlen);
+      free(c->sets);
+      free(c->table);
+      free(c->stack);
+      free(c->work);
+      free(c->list);
+      free(c->origin);
+      free(c->listorigin);
+      free(c->mark);
+      free(c->starts);
+      free(c->ends);
+    }
+    free(re->caches);
+  }
+  free(re->nodes);
+  free(re->classes);
+  free(re->fwd.insts);
+  free(re->rev.insts);
+  free(re);
+}
+
+// Returns NULL and sets *error if the query is not a valid pattern.
+regex *regexCompile(const char *query, int len, int icase, const char **error)
+{
+  regex *re = calloc(1, sizeof(regex));
+  regexParser ps = {re, query, len, 0, icase, NULL};
+  int root = regexParseAlt(&ps);
+  if (!ps.error && ps.pos < len)
+    ps.error = "unmatched )";
+
+  if (!ps.error)
+  {
+    re->fwd.match = regexEmit(&re->fwd, RI_MATCH, 0, 0);
+    re->fwd.start = regexCompileNode(re, &re->fwd, root, re->fwd.match, 0);
+
+    int any = regexNewClass(&ps);
+    memset(re->classes[any], 0xff, sizeof(re->classes[0]));
+    re->rev.match = regexEmit(&re->rev, RI_MATCH, 0, 0);
+    int body = regexCompileNode(re, &re->rev, root, re->rev.match, 1);
+    int loop = regexEmit(&re->rev, RI_SPLIT, body, 0);
+    int skip = regexEmit(&re->rev, RI_BYTE, loop, any);
+    re->rev.insts[loop].out1 = skip;
+    re->rev.start = loop;
+
+    if (re->fwd.numinsts > WILO_REGEX_MAX_INSTS || re->rev.numinsts > WILO_REGEX_MAX_INSTS)
+      ps.error = "pattern too large";
+  }
+  free(re->nodes);
+  re->nodes = NULL;
+
+  if (ps.error)
+  {
+    *error = ps.error;
+    regexFree(re);
+    return NULL;
+  }
+  regexByteClasses(re);
+  re->caches = calloc(2 * WILO_MAX_WORKERS, sizeof(regexCache));
+  return re;
+}
+
+// Smart case as for literal queries, except that escapes such as \S do not
+// count as uppercase letters.
+int regexIgnoresCase(const char *query)
+{
+  for (; *query; query++)
+  {
+    if (*query == '\\' && query[1])
+      query++;
+    else if (*query >= 'A' && *query <= 'Z')
+      return 0;
+  }
+  return 1;
+}
+
+void regexNextGen(regexCache *c)
+{
+  if (++c->gen == 0)
+  {
+    memset(c->mark, 0, sizeof(unsigned int) * c->prog->numinsts);
+    c->gen = 1;
+  }
+}
+
+// Adds the first sp instructions on the stack and what they reach without
+// reading a byte to set. Assertions are passed when flags allow; RI_END is
+// kept otherwise, since it can still hold once the scan reaches the end.
+void regexClosure(regexCache *c, int sp, int flags, int *set, int *n)
+{
+  regexInst *insts = c->prog->insts;
+  while (sp)
+  {
+    int i = c->stack[--sp];
+    if (c->mark[i] == c->gen)
+      continue;
+    c->mark[i] = c->gen;
+    switch (insts[i].op)
+    {
+    case RI_SPLIT:
+      c->stack[sp++] = insts[i].out1;
+      c->stack[sp++] = insts[i].out;
+      break;
+    case RI_BEGIN:
+      if (flags & RX_AT_BEGIN)
+        c->stack[sp++] = insts[i].out;
+      break;
+    case RI_END:
+      if (flags & RX_AT_END)
+        c->stack[sp++] = insts[i].out;
+      else
+        set[(*n)++] = i;
+      break;
+    default:
+      set[(*n)++] = i;
+      break;
+    }
+  }
+}
+
+int regexCompareInsts(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+// Returns the RX_ACCEPT bits of a set of n NFA states. Accepting at the end
+// also counts the matches behind RI_END.
+int regexAccepts(regexCache *c, int *set, int n)
+{
+  regexInst *insts = c->prog->insts;
+  int accept = 0, atend = 0, sp = 0;
+  regexNextGen(c);
+  for (int i = 0; i < n; i++)
+  {
+    if (insts[set[i]].op == RI_MATCH)
+      accept = 1;
+    else if (insts[set[i]].op == RI_END)
+      c->stack[sp++] = insts[set[i]].out;
+  }
+  while (sp)
+  {
+    int i = c->stack[--sp];
+    if (c->mark[i] == c->gen)
+      continue;
+    c->mark[i] = c->gen;
+    if (insts[i].op == RI_MATCH)
+      atend = 1;
+    else if (insts[i].op == RI_SPLIT)
+    {
+      c->stack[sp++] = insts[i].out1;
+      c->stack[sp++] = insts[i].out;
+    }
+    else if (insts[i].op == RI_END)
+      c->stack[sp++] = insts[i].out;
+  }
+  return (accept ? RX_ACCEPT : 0) | (accept || atend ? RX_ACCEPT_AT_END : 0);
+}
+
+// Finds or adds the state for the first n NFA states in the work set.
+// Returns -1 when the cache is full.
+int regexAddState(regex *re, regexCache *c, int n)
+{
+  qsort(c->work, n, sizeof(int), regexCompareInsts);
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++)
+    h = (h ^ (unsigned int)c->work[i]) * 16777619u;
+
+  unsigned int mask = 2 * WILO_REGEX_STATES - 1;
+  unsigned int slot = h & mask;
+  for (; c->table[slot] >= 0; slot = (slot + 1) & mask)
+  {
+    int id = c->table[slot];
+    if (c->setlen[id] == n && !memcmp(&c->sets[c->setoff[id]], c->work, sizeof(int) * n))
+      return id;
+  }
+  if (c->numstates == WILO_REGEX_STATES)
+    return -1;
+
+  int ncls = re->numbyteclasses;
+  if (c->numstates == c->statecap)
+  {
+    c->statecap = c->statecap ? c->statecap * 2 : 64;
+    c->next = realloc(c->next, sizeof(int) * ncls * c->statecap);
+    c->accept = realloc(c->accept, c->statecap);
+    c->setoff = realloc(c->setoff, sizeof(int) * c->statecap);
+    c->setlen = realloc(c->setlen, sizeof(int) * c->statecap);
+  }
+  if (c->setsused + n > c->setscap)
+  {
+    while (c->setsused + n > c->setscap)
+      c->setscap = c->setscap ? c->setscap * 2 : 1024;
+    c->sets = realloc(c->sets, sizeof(int) * c->setscap);
+  }
+
+  int id = c->numstates++;
+  c->table[slot] = id;
+  c->setoff[id] = c->setsused;
+  c->setlen[id] = n;
+  if (n)
+    memcpy(&c->sets[c->setsused], c->work, sizeof(int) * n);
+  c->setsused += n;
+  memset(&c->next[id * ncls], 0xff, sizeof(int) * ncls);
+  c->accept[id] = regexAccepts(c, c->work, n);
+  return id;
+}
+
+void regexCacheClear(regex *re, regexCache *c)
+{
+  memset(c->table, 0xff, sizeof(int) * 2 * WILO_REGEX_STATES);
+  c->numstates = 0;
+  c->setsused = 0;
+  for (int i = 0; i < 4; i++)
+    c->start[i] = -1;
+  int dead = regexAddState(re, c, 0);
+  memset(&c->next[dead * re->numbyteclasses], 0, sizeof(int) * re->numbyteclasses);
+}
+
+regexCache *regexCacheFor(regex *re, int worker, int reverse)
+{
+  regexCache *c = &re->caches[2 * worker + reverse];
+  if (c->table == NULL)
+  {
+    c->prog = reverse ? &re->rev : &re->fwd;
+    c->table = malloc(sizeof(int) * 2 * WILO_REGEX_STATES);
+    c->stack = malloc(sizeof(int) * (3 * c->prog->numinsts + 2));
+    c->work = malloc(sizeof(int) * (c->prog->numinsts + 1));
+    c->list = malloc(sizeof(int) * (c->prog->numinsts + 1));
+    if (reverse)
+    {
+      c->origin = malloc(sizeof(int) * (c->prog->numinsts + 1));
+      c->listorigin = malloc(sizeof(int) * (c->prog->numinsts + 1));
+    }
+    c->mark = calloc(c->prog->numinsts, sizeof(unsigned int));
+    regexCacheClear(re, c);
+  }
+  return c;
+}
+
+// Adds the state in the work set, emptying the cache first if it is full.
+int regexAddOrFlush(regex *re, regexCache *c, int n)
+{
+  int id = regexAddState(re, c, n);
+  if (id < 0)
+  {
+    if (c->scanned - c->flushedat < (unsigned long)WILO_REGEX_STATES * WILO_REGEX_MIN_BYTES_PER_STATE)
+      c->nfa = 1;
+    c->flushedat = c->scanned;
+    c->flushes++;
+    regexCacheClear(re, c);
+    id = regexAddState(re, c, n);
+  }
+  return id;
+}
+
+// Pushes where the n NFA states in set go on byte b onto the stack. Returns
+// how many it pushed.
+int regexPushNext(regex *re, regexCache *c, int *set, int n, int b)
+{
+  int sp = 0;
+  for (int k = n - 1; k >= 0; k--)
+  {
+    regexInst *in = &c->prog->insts[set[k]];
+    if (in->op == RI_BYTE && (re->classes[in->out1][b >> 3] & (1 << (b & 7))))
+      c->stack[sp++] = in->out;
+  }
+  return sp;
+}
+
+int regexStep(regex *re, regexCache *c, int state, int cls)
+{
+  int sp = regexPushNext(re, c, &c->sets[c->setoff[state]], c->setlen[state], re->classbyte[cls]);
+  int n = 0;
+  regexNextGen(c);
+  regexClosure(c, sp, 0, c->work, &n);
+  unsigned long flushes = c->flushes;
+  int id = regexAddOrFlush(re, c, n);
+  if (c->flushes == flushes)
+    c->next[state * re->numbyteclasses + cls] = id;
+  return id;
+}
+
+int regexStart(regex *re, regexCache *c, int flags)
+{
+  if (c->start[flags] < 0)
+  {
+    int n = 0;
+    c->stack[0] = c->prog->start;
+    regexNextGen(c);
+    regexClosure(c, 1, flags, c->work, &n);
+    int id = regexAddOrFlush(re, c, n);
+    c->start[flags] = id;
+  }
+  return c->start[flags];
+}
+
+// Copies the NFA states of a DFA state to the work set and returns how many
+// there are.
+int regexLoadState(regexCache *c, int state)
+{
+  memcpy(c->work, &c->sets[c->setoff[state]], sizeof(int) * c->setlen[state]);
+  return c->setlen[state];
+}
+
+// Moves the n NFA states in set over byte b into to. Returns how many it
+// reaches; RI_MATCH is among them if it was marked.
+int regexNfaStep(regex *re, regexCache *c, int *set, int n, int b, int *to)
+{
+  int sp = regexPushNext(re, c, set, n, b);
+  int m = 0;
+  regexNextGen(c);
+  regexClosure(c, sp, 0, to, &m);
+  return m;
+}
+
+// Marks the starts before offset p as regexMarkStarts does, stepping the n
+// NFA states in the work set instead of the DFA.
+int regexMarkStartsNfa(regex *re, regexCache *c, const char *s, int p, int n)
+{
+  int *set = c->work, *other = c->list;
+  int any = 0;
+  while (--p >= 0)
+  {
+    n = regexNfaStep(re, c, set, n, (unsigned char)s[p], other);
+    int *t = set;
+    set = other;
+    other = t;
+    int hit = p == 0 ? regexAccepts(c, set, n) & RX_ACCEPT_AT_END : c->mark[c->prog->match] == c->gen;
+    c->starts[p] = hit != 0;
+    any |= hit;
+  }
+  return any != 0;
+}
+
+// Scans s backwards to mark every offset where a match starts. Returns 0 if
+// there is none.
+int regexMarkStarts(regex *re, int worker, const char *s, int len)
+{
+  regexCache *c = regexCacheFor(re, worker, 1);
+  if (c->startscap < len + 1)
+  {
+    c->startscap = len + 1;
+    c->starts = realloc(c->starts, c->startscap);
+    c->ends = realloc(c->ends, sizeof(int) * c->startscap);
+  }
+  c->rowscanned = 0;
+  c->hasends = 0;
+
+  int flags = RX_AT_BEGIN | (len == 0 ? RX_AT_END : 0);
+  if (c->nfa)
+  {
+    int n = 0;
+    c->stack[0] = c->prog->start;
+    regexNextGen(c);
+    regexClosure(c, 1, flags, c->work, &n);
+    return regexMarkStartsNfa(re, c, s, len, n);
+  }
+
+  int ncls = re->numbyteclasses;
+  int state = regexStart(re, c, flags);
+  int *next = c->next;
+  unsigned char *accept = c->accept;
+  unsigned char *starts = c->starts;
+  int any = 0, counted = len;
+  for (int p = len - 1; p >= 0; p--)
+  {
+    int cls = re->bytemap[(unsigned char)s[p]];
+    int to = next[state * ncls + cls];
+    if (to < 0)
+    {
+      c->scanned += counted - p;
+      counted = p;
+      to = regexStep(re, c, state, cls);
+      next = c->next;
+      accept = c->accept;
+      if (c->nfa)
+      {
+        starts[p] = (accept[to] & (p == 0 ? RX_ACCEPT_AT_END : RX_ACCEPT)) != 0;
+        any |= starts[p];
+        return regexMarkStartsNfa(re, c, s, p, regexLoadState(c, to)) || any;
+      }
+    }
+    state = to;
+    unsigned char hit = accept[state] & (p == 0 ? RX_ACCEPT_AT_END : RX_ACCEPT);
+    starts[p] = hit != 0;
+    any |= hit;
+  }
+  c->scanned += counted;
+  return any != 0;
+}
+
+// Goes on with regexLongest from offset i on the NFA, with the n NFA states
+// in the work set and end the longest match so far.
+int regexLongestNfa(regex *re, regexCache *c, const char *s, int len, int i, int n, int end, int *stop)
+{
+  int *set = c->work, *other = c->list;
+  for (; i < len && n; i++)
+  {
+    n = regexNfaStep(re, c, set, n, (unsigned char)s[i], other);
+    int *t = set;
+    set = other;
+    other = t;
+    if (i + 1 == len ? regexAccepts(c, set, n) & RX_ACCEPT_AT_END : c->mark[c->prog->match] == c->gen)
+      end = i + 1;
+  }
+  *stop = i;
+  return end;
+}
+
+// Returns the end of the longest match that starts at from, or -1, and sets
+// *stop to where the scan ended.
+int regexLongest(regex *re, int worker, const char *s, int len, int from, int *stop)
+{
+  regexCache *c = regexCacheFor(re, worker, 0);
+  int flags = (from == 0 ? RX_AT_BEGIN : 0) | (from == len ? RX_AT_END : 0);
+  if (c->nfa)
+  {
+    int n = 0;
+    c->stack[0] = c->prog->start;
+    regexNextGen(c);
+    regexClosure(c, 1, flags, c->work, &n);
+    int end = (regexAccepts(c, c->work, n) & RX_ACCEPT) ? from : -1;
+    return regexLongestNfa(re, c, s, len, from, n, end, stop);
+  }
+
+  int ncls = re->numbyteclasses;
+  int state = regexStart(re, c, flags);
+  int *next = c->next;
+  unsigned char *accept = c->accept;
+  int end = (accept[state] & RX_ACCEPT) ? from : -1;
+  int i = from, counted = from;
+  for (; i < len && state != 0; i++)
+  {
+    int cls = re->bytemap[(unsigned char)s[i]];
+    int to = next[state * ncls + cls];
+    if (to < 0)
+    {
+      c->scanned += i - counted;
+      counted = i;
+      to = regexStep(re, c, state, cls);
+      next = c->next;
+      accept = c->accept;
+      if (c->nfa)
+      {
+        if (accept[to] & (i + 1 == len ? RX_ACCEPT_AT_END : RX_ACCEPT))
+          end = i + 1;
+        return regexLongestNfa(re, c, s, len, i + 1, regexLoadState(c, to), end, stop);
+      }
+    }
+    state = to;
+    if (accept[state] & (i + 1 == len ? RX_ACCEPT_AT_END : RX_ACCEPT))
+      end = i + 1;
+  }
+  c->scanned += i - counted;
+  *stop = i;
+  return end;
+}
+
+// Sets ends[p] to the end of the longest match that starts at p, or to -1,
+// for every offset of s in one backward pass over the reverse NFA. Each
+// thread keeps the offset where it started, which is where its match ends.
+// Of two threads in the same NFA state the later end wins: they have the
+// same future, and the longer match is the one wanted.
+void regexMarkEnds(regex *re, regexCache *c, const char *s, int len)
+{
+  regexInst *insts = c->prog->insts;
+  int body = insts[c->prog->start].out;
+  int *set = c->work, *other = c->list;
+  int *origin = c->origin, *otherorigin = c->listorigin;
+  int n = 0;
+  regexNextGen(c);
+  c->stack[0] = body;
+  regexClosure(c, 1, RX_AT_BEGIN, set, &n);
+  for (int k = 0; k < n; k++)
+    origin[k] = len;
+
+  for (int p = len - 1; p >= 0; p--)
+  {
+    int b = (unsigned char)s[p], m = 0;
+    regexNextGen(c);
+    for (int k = 0; k < n; k++)
+    {
+      regexInst *in = &insts[set[k]];
+      if (in->op != RI_BYTE || !(re->classes[in->out1][b >> 3] & (1 << (b & 7))))
+        continue;
+      int first = m;
+      c->stack[0] = in->out;
+      regexClosure(c, 1, 0, other, &m);
+      for (; first < m; first++)
+        otherorigin[first] = origin[k];
+    }
+    int *t = set;
+    set = other;
+    other = t;
+    t = origin;
+    origin = otherorigin;
+    otherorigin = t;
+    n = m;
+
+    // Threads are kept latest end first, so the first that accepts wins.
+    c->ends[p] = -1;
+    for (int k = 0; k < n; k++)
+    {
+      int op = insts[set[k]].op;
+      if (op == RI_MATCH || (p == 0 && op == RI_END && (regexAccepts(c, &set[k], 1) & RX_ACCEPT_AT_END)))
+      {
+        c->ends[p] = origin[k];
+        break;
+      }
+    }
+    if (p == 0)
+      break;
+
+    // The thread that ends at p goes last; the marks of the step drop the
+    // states that a later end already holds.
+    int first = n;
+    c->stack[0] = body;
+    regexClosure(c, 1, 0, set, &n);
+    for (; first < n; first++)
+      origin[first] = p;
+  }
+}
+
+// Returns the start of the leftmost-longest non-empty match in s[from, len)
+// and sets *end, or -1. The starts must have been marked for s.
+//
+// Each marked start is scanned forward until the DFA dies. When those scans
+// read far past the matches they find, as a|a[^x]*x does on a row of a's,
+// the row would take quadratic time; once they have read twice the row, the
+// ends of the whole row are found in one pass instead.
+int regexNext(regex *re, int worker, const char *s, int len, int from, int *end)
+{
+  regexCache *rc = &re->caches[2 * worker + 1];
+  unsigned char *starts = rc->starts;
+  while (from < len)
+  {
+    if (rc->rowscanned > 2 * (long)len + 256)
+    {
+      if (!rc->hasends)
+      {
+        regexMarkEnds(re, rc, s, len);
+        rc->hasends = 1;
+      }
+      for (int p = from; p < len; p++)
+      {
+        if (rc->ends[p] > p)
+        {
+          *end = rc->ends[p];
+          return p;
+        }
+      }
+      return -1;
+    }
+    unsigned char *hit = memchr(&starts[from], 1, len - from);
+    if (hit == NULL)
+      return -1;
+    int p = hit - starts;
+    int stop;
+    int e = regexLongest(re, worker, s, len, p, &stop);
+    rc->rowscanned += stop - p;
+    if (e > p)
+    {
+      *end = e;
+      return p;
+    }
+    from = p + 1;
+  }
+  return -1;
+}
+
+/*** find ***/
+
+// Literal search over the bytes of a row. Rows can hold NULs, so matching
+// goes by length rather than by C string. With SSE2, 16 positions at a time
+// are filtered on the first and last byte of the pattern and only the
+// survivors are compared in full; the tail of a row, and builds without
+// SSE2, use Horspool. Case-insensitive patterns fold ASCII letters on both
+// sides.
+
+typedef struct searchPattern
+{
+  char *text;
+  int len;
+  int icase;
+  // Horspool shift for the (folded) byte under the last pattern position.
+  int skip[256];
+  // Set for a regex query, which is matched with regexMarkStarts and
+  // regexNext instead.
+  regex *re;
+} searchPattern;
+
+unsigned char searchFoldByte(unsigned char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+void searchCompile(searchPattern *p, const char *query, int len, int icase)
+{
+  regexFree(p->re);
+  p->re = NULL;
+  free(p->text);
+  p->text = malloc(len + 1);
+  p->len = len;
+  p->icase = icase;
+  for (int i = 0; i < len; i++)
+    p->text[i] = icase ? searchFoldByte(query[i]) : query[i];
+  p->text[len] = '\0';
+
+  for (int c = 0; c < 256; c++)
+    p->skip[c] = len;
+  for (int i = 0; i < len - 1; i++)
+    p->skip[(unsigned char)p->text[i]] = len - 1 - i;
+}
+
+void searchFree(searchPattern *p)
+{
+  free(p->text);
+  p->text = NULL;
+  p->len = 0;
+  regexFree(p->re);
+  p->re = NULL;
+}
+
+// Compiles query as a regex. Returns NULL, or what is wrong with it.
+const char *searchCompileRegex(searchPattern *p, const char *query)
+{
+  const char *error = NULL;
+  searchFree(p);
+  p->re = regexCompile(query, strlen(query), regexIgnoresCase(query), &error);
+  return error;
+}
+
+int searchEqual(searchPattern *p, const char *s, const char *text, int len)
+{
+  if (!p->icase)
+    return !memcmp(s, text, len);
+  for (int i = 0; i < len; i++)
+  {
+    if (searchFoldByte(s[i]) != (unsigned char)text[i])
+      return 0;
+  }
+  return 1;
+}
+
+#ifdef WILO_SSE2
+__m128i searchFoldBlock(__m128i v)
+{
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// Returns the offset of the first match in s[from, len), or -1.
+int searchFind(searchPattern *p, const char *s, int len, int from)
+{
+  int n = p->len;
+  if (n == 0)
+    return from <= len ? from : -1;
+  if (n == 1 && !p->icase)
+  {
+    char *hit = from < len ? memchr(&s[from], p->text[0], len - from) : NULL;
+    return hit ? (int)(hit - s) : -1;
+  }
+  int i = from;
+
+#ifdef WILO_SSE2
+  // Positions past the last full block are covered by one more block that
+  // ends at the last candidate, skipping the ones already checked.
+  int lastblock = len - n + 1 - 16;
+  if (lastblock >= i)
+  {
+    __m128i first = _mm_set1_epi8(p->text[0]);
+    __m128i last = _mm_set1_epi8(p->text[n - 1]);
+    unsigned int keep = 0xffff;
+    while (1)
+    {
+      __m128i a = _mm_loadu_si128((__m128i *)&s[i]);
+      __m128i b = _mm_loadu_si128((__m128i *)&s[i + n - 1]);
+      if (p->icase)
+      {
+        a = searchFoldBlock(a);
+        b = searchFoldBlock(b);
+      }
+      unsigned int mask = keep & (unsigned int)_mm_movemask_epi8(
+                                      _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+      while (mask)
+      {
+        int at = i + ctz32(mask);
+        if (n <= 2 || searchEqual(p, &s[at + 1], &p->text[1], n - 2))
+          return at;
+        mask &= mask - 1;
+      }
+      if (i == lastblock)
+        return -1;
+      i += 16;
+      if (i > lastblock)
+      {
+        keep = 0xffff << (i - lastblock);
+        i = lastblock;
+      }
+    }
+  }
+#endif
+
+  unsigned char lastbyte = p->text[n - 1];
+  while (i + n <= len)
+  {
+    unsigned char c = s[i + n - 1];
+    if (p->icase)
+      c = searchFoldByte(c);
+    if (c == lastbyte && searchEqual(p, &s[i], p->text, n - 1))
+      return i;
+    i += p->skip[c];
+  }
+  return -1;
+}
+
+// Smart case: a query with an uppercase letter in it matches exactly.
+int searchQueryIgnoresCase(const char *query)
+{
+  for (; *query; query++)
+  {
+    if (*query >= 'A' && *query <= 'Z')
+      return 0;
+  }
+  return 1;
+}
+
+// Every match of the query in the find prompt, in file order, so arrows step
+// through them by index and the status bar can show "match k of N". The scan
+// is split into chunks of rows for the worker pool.
+
+typedef struct findMatch
+{
+  int row;
+  int col;
+  int len;
+} findMatch;
+
+typedef struct findResults
+{
+  int active;
+  // Ctrl-R in the prompt switches between literal and regex queries.
+  int regex;
+  const char *error;
+  char *query;
+  int complete;
+  findMatch *matches;
+  int count;
+  int cap;
+  int current;
+  // The cursor when the prompt opened; a new query jumps to the first
+  // match from there.
+  int fromrow;
+  int fromcol;
+  // The first match of base, the last query scanned to the end, in each row
+  // that has one. A query that extends base starts with it, so it can only
+  // match in these rows, from that column on.
+  char *base;
+  findMatch *candidates;
+  int numcandidates;
+} findResults;
+
+findResults found;
+
+typedef struct findChunk
+{
+  findMatch *matches;
+  int count;
+  int cap;
+} findChunk;
+
+typedef struct findJob
+{
+  searchPattern *pattern;
+  // The rows to search and the column to start at, or NULL for all rows.
+  findMatch *rows;
+  int numrows;
+  int first;
+  findChunk *chunks;
+} findJob;
+
+void findAppend(findMatch **matches, int *count, int *cap, findMatch *add, int numadd)
+{
+  if (numadd == 0)
+    return;
+  if (*count + numadd > *cap)
+  {
+    while (*count + numadd > *cap)
+      *cap = *cap ? *cap * 2 : 64;
+    *matches = realloc(*matches, sizeof(findMatch) * *cap);
+  }
+  memcpy(&(*matches)[*count], add, sizeof(findMatch) * numadd);
+  *count += numadd;
+}
+
+void editorFindScan(int task, int worker, void *arg)
+{
+  findJob *job = arg;
+  findChunk *c = &job->chunks[task];
+  searchPattern *p = job->pattern;
+  int step = p->len > 0 ? p->len : 1;
+  int lo = (job->first + task) * WILO_FIND_CHUNK_ROWS;
+  int hi = lo + WILO_FIND_CHUNK_ROWS < job->numrows ? lo + WILO_FIND_CHUNK_ROWS : job->numrows;
+
+  c->count = 0;
+  for (int k = lo; k < hi; k++)
+  {
+    int y = job->rows ? job->rows[k].row : k;
+    int from = job->rows ? job->rows[k].col : 0;
+    erow *row = editorRowAt(y);
+    if (p->re)
+    {
+      if (!regexMarkStarts(p->re, worker, row->chars, row->size))
+        continue;
+      int end;
+      for (int m = regexNext(p->re, worker, row->chars, row->size, from, &end); m != -1;
+           m = regexNext(p->re, worker, row->chars, row->size, end, &end))
+      {
+        findMatch match = {y, m, end - m};
+        findAppend(&c->matches, &c->count, &c->cap, &match, 1);
+      }
+      continue;
+    }
+    for (int m = searchFind(p, row->chars, row->size, from); m != -1;
+         m = searchFind(p, row->chars, row->size, m + step))
+    {
+      findMatch match = {y, m, p->len};
+      findAppend(&c->matches, &c->count, &c->cap, &match, 1);
+    }
+  }
+}
+
+// Collects every match in the given rows (all rows when NULL) into found,
+// one chunk per worker at a time. A key that arrives in between is about to
+// change the query, so the scan stops there and returns 0 with found
+// incomplete.
+int editorFindAll(searchPattern *pattern, findMatch *rows, int numrows)
+{
+  int workers = poolSize();
+  int numchunks = (numrows + WILO_FIND_CHUNK_ROWS - 1) / WILO_FIND_CHUNK_ROWS;
+  findJob job;
+  job.pattern = pattern;
+  job.rows = rows;
+  job.numrows = numrows;
+  job.chunks = calloc(workers, sizeof(findChunk));
+
+  found.count = 0;
+  found.current = -1;
+  for (job.first = 0; job.first < numchunks; job.first += workers)
+  {
+    if (job.first > 0 && inputPending(0))
+      break;
+    int n = numchunks - job.first < workers ? numchunks - job.first : workers;
+    poolRun(n, editorFindScan, &job);
+    for (int i = 0; i < n; i++)
+      findAppend(&found.matches, &found.count, &found.cap, job.chunks[i].matches, job.chunks[i].count);
+  }
+  found.complete = job.first >= numchunks;
+
+  for (int i = 0; i < workers; i++)
+    free(job.chunks[i].matches);
+  free(job.chunks);
+  return found.complete;
+}
+
+// Index of the first match at or after (row, col), wrapping to the first.
+int editorFindFrom(int row, int col)
+{
+  int lo = 0, hi = found.count;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    findMatch *m = &found.matches[mid];
+    if (m->row < row || (m->row == row && m->col < col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < found.count ? lo : 0;
+}
+
+void editorFindReset()
+{
+  free(found.query);
+  found.query = NULL;
+  found.error = NULL;
+  found.complete = 0;
+  found.count = 0;
+  found.current = -1;
+}
+
+// Makes the complete results of found.query the base for narrowing.
+void editorFindSetBase()
+{
+  free(found.base);
+  found.base = _strdup(found.query);
+  found.candidates = realloc(found.candidates, sizeof(findMatch) * (found.count + 1));
+  found.numcandidates = 0;
+  for (int i = 0; i < found.count; i++)
+  {
+    if (found.numcandidates == 0 || found.candidates[found.numcandidates - 1].row != found.matches[i].row)
+      found.candidates[found.numcandidates++] = found.matches[i];
+  }
+}
+
+void editorFindClearBase()
+{
+  free(found.base);
+  found.base = NULL;
+  found.numcandidates = 0;
+}
+
+void editorFindCallback(char *query, int key)
+{
+  static searchPattern pattern;
+
+  E.match.row = -1;
+
+  if (key == '\r' || key == '\x1b')
+  {
+    searchFree(&pattern);
+    editorFindReset();
+    editorFindClearBase();
+    found.active = 0;
+    return;
+  }
+
+  if (key == CTRL_KEY('r'))
+  {
+    found.regex = !found.regex;
+    editorFindReset();
+    editorFindClearBase();
+  }
+
+  int step = 0;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    step = 1;
+  else if (key == ARROW_LEFT || key == ARROW_UP)
+    step = -1;
+
+  if (found.query == NULL || strcmp(found.query, query) || !found.complete)
+  {
+    editorFindReset();
+    found.query = _strdup(query);
+    if (query[0] == '\0')
+    {
+      found.complete = 1;
+      return;
+    }
+    if (found.regex)
+    {
+      found.error = searchCompileRegex(&pattern, query);
+      if (found.error)
+      {
+        found.complete = 1;
+        return;
+      }
+    }
+    else
+    {
+      searchCompile(&pattern, query, strlen(query), searchQueryIgnoresCase(query));
+    }
+    // Typing on only narrows literal matches; backspace or another edit
+    // starts over from every row, or from the rows the index has for the
+    // query. A regex that grows can match more, so it scans every row.
+    int narrow = !found.regex && found.base && !strncmp(found.base, query, strlen(found.base));
+    findMatch *rows = narrow ? found.candidates : NULL;
+    int numrows = narrow ? found.numcandidates : E.numrows;
+    int *indexed = NULL;
+    int numindexed = narrow || found.regex ? -1 : editorIndexCandidates(query, strlen(query), &indexed);
+    if (numindexed >= 0)
+    {
+      rows = malloc(sizeof(findMatch) * (numindexed + 1));
+      for (int i = 0; i < numindexed; i++)
+      {
+        rows[i].row = indexed[i];
+        rows[i].col = 0;
+        rows[i].len = 0;
+      }
+      numrows = numindexed;
+      free(indexed);
+    }
+    int complete = editorFindAll(&pattern, rows, numrows);
+    if (numindexed >= 0)
+      free(rows);
+    if (!complete)
+      return;
+    if (!found.regex)
+      editorFindSetBase();
+    if (found.count == 0)
+      return;
+    found.current = editorFindFrom(found.fromrow, found.fromcol);
+  }
+  else if (found.count > 0)
+  {
+    found.current = (found.current + step + found.count) % found.count;
+  }
+  if (found.count == 0)
+    return;
+
+  findMatch *m = &found.matches[found.current];
+  erow *row = editorRowAt(m->row);
+  E.cy = m->row;
+  E.cx = m->col;
+  E.rowoff = E.numrows;
+
+  E.match.row = m->row;
+  E.match.start = editorRowCxtoRx(row, m->col);
+  E.match.len = editorRowCxtoRx(row, m->col + m->len) - E.match.start;
+}
+
+void editorFind()
+{
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  found.active = 1;
+  found.fromrow = E.cy;
+  found.fromcol = E.cx;
+
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback);
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** trigram index ***/
+
+// With -i every row is indexed by the case-folded trigrams in it, so a query
+// of three or more bytes only verifies the rows in blocks that hold all of
+// its rarest trigrams. Trigrams are hashed into buckets, and each bucket has
+// a posting list of blocks of WILO_INDEX_BLOCK row ids. Ids are given out in
+// insertion order and never change, so inserting or deleting rows leaves the
+// lists alone.
+//
+// Lists only grow: an edited row adds its new trigrams and keeps the old
+// ones, so a list may name blocks that no longer match but never misses one
+// that does. The rows of a mapped file are indexed on a background thread
+// after it is opened; edits made in the meantime are added when the index is
+// first used.
+
+typedef struct indexList
+{
+  unsigned int *blocks;
+  int count;
+  int cap;
+} indexList;
+
+typedef struct indexBuild
+{
+  char *buf;
+  size_t len;
+  unsigned int firstid;
+  int numrows;
+  DWORD start;
+  indexList *lists;
+} indexBuild;
+
+typedef struct trigramIndex
+{
+  int enabled;
+  // NULL until the first build is done.
+  indexList *lists;
+  unsigned int nextid;
+  // Rows inserted or changed since the lists were last brought up to date.
+  unsigned int *dirty;
+  int numdirty;
+  int dirtycap;
+  // The row of each id, or -1 once it is deleted. Rebuilt after rows move.
+  int *rowof;
+  unsigned int rowofcap;
+  int rowofvalid;
+} trigramIndex;
+
+trigramIndex trigrams;
+
+typedef struct indexThread
+{
+  int running;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+  CONDITION_VARIABLE idle;
+  indexBuild *pending;
+  indexBuild *busy;
+  indexBuild *done;
+  int cancel;
+} indexThread;
+
+indexThread indexbg;
+
+unsigned int indexBucket(unsigned int trigram)
+{
+  return (trigram * 2654435761u) >> (32 - WILO_INDEX_BITS);
+}
+
+void indexAddText(indexList *lists, unsigned int id, const char *s, int len)
+{
+  unsigned int block = id / WILO_INDEX_BLOCK;
+  unsigned int t = 0;
+  for (int i = 0; i < len; i++)
+  {
+    t = ((t << 8) | searchFoldByte(s[i])) & 0xffffff;
+    if (i < 2)
+      continue;
+    indexList *l = &lists[indexBucket(t)];
+    if (l->count && l->blocks[l->count - 1] == block)
+      continue;
+    if (l->count == l->cap)
+    {
+      l->cap = l->cap ? l->cap * 2 : 4;
+      l->blocks = realloc(l->blocks, sizeof(unsigned int) * l->cap);
+    }
+    l->blocks[l->count++] = block;
+  }
+}
+
+void indexListsFree(indexList *lists)
+{
+  if (lists == NULL)
+    return;
+  for (int i = 0; i < (1 << WILO_INDEX_BITS); i++)
+    free(lists[i].blocks);
+  free(lists);
+}
+
+void indexMarkDirty(unsigned int id)
+{
+  if (trigrams.numdirty && trigrams.dirty[trigrams.numdirty - 1] == id)
+    return;
+  if (trigrams.numdirty == trigrams.dirtycap)
+  {
+    trigrams.dirtycap = trigrams.dirtycap ? trigrams.dirtycap * 2 : 64;
+    trigrams.dirty = realloc(trigrams.dirty, sizeof(unsigned int) * trigrams.dirtycap);
+  }
+  trigrams.dirty[trigrams.numdirty++] = id;
+}
+
+void indexRowInserted(erow *row)
+{
+  row->id = trigrams.nextid++;
+  if (trigrams.enabled)
+  {
+    trigrams.rowofvalid = 0;
+    indexMarkDirty(row->id);
+  }
+}
+
+void indexRowChanged(erow *row)
+{
+  if (trigrams.enabled)
+    indexMarkDirty(row->id);
+}
+
+void indexRowsMoved()
+{
+  trigrams.rowofvalid = 0;
+}
+
+// Splits the mapped text into rows the way editorLoadLines does. A row keeps
+// its line ending here, which only adds trigrams. Returns 0 if cancelled.
+int editorIndexBuild(indexBuild *b)
+{
+  char *line = b->buf;
+  char *end = b->buf + b->len;
+  unsigned int id = b->firstid;
+  while (line < end)
+  {
+    char *nl = memchr(line, '\n', end - line);
+    if (nl == NULL)
+      nl = end;
+    indexAddText(b->lists, id++, line, nl - line);
+    line = nl + 1;
+
+    if ((id & 0xffff) == 0)
+    {
+      EnterCriticalSection(&indexbg.lock);
+      int cancel = indexbg.cancel;
+      LeaveCriticalSection(&indexbg.lock);
+      if (cancel)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+void indexBuildFree(indexBuild *b)
+{
+  indexListsFree(b->lists);
+  free(b);
+}
+
+DWORD WINAPI editorIndexThread(void *param)
+{
+  (void)param;
+
+  EnterCriticalSection(&indexbg.lock);
+  for (;;)
+  {
+    while (indexbg.pending == NULL)
+      SleepConditionVariableCS(&indexbg.wake, &indexbg.lock, INFINITE);
+    indexbg.busy = indexbg.pending;
+    indexbg.pending = NULL;
+    LeaveCriticalSection(&indexbg.lock);
+
+    int complete = editorIndexBuild(indexbg.busy);
+
+    EnterCriticalSection(&indexbg.lock);
+    if (complete)
+      indexbg.done = indexbg.busy;
+    else
+      indexBuildFree(indexbg.busy);
+    indexbg.busy = NULL;
+    WakeAllConditionVariable(&indexbg.idle);
+    inputWake();
+  }
+  return 0;
+}
+
+// Indexes every row on the main thread when the index is first used.
+void editorIndexFromRows()
+{
+  trigrams.lists = calloc(1 << WILO_INDEX_BITS, sizeof(indexList));
+  trigrams.numdirty = 0;
+  for (int j = 0; j < E.numrows; j++)
+    indexMarkDirty(editorRowAt(j)->id);
+}
+
+void editorIndexApply(indexBuild *b)
+{
+  trigrams.lists = b->lists;
+  editorSetStatusMessage("Indexed %d rows in %lu ms", b->numrows, (unsigned long)(GetTickCount() - b->start));
+  E.redraw = 1;
+  free(b);
+}
+
+// Stops a build before the mapping it reads is unmapped. Rows it had not
+// indexed yet are indexed from the rows instead.
+void editorIndexCancel()
+{
+  if (!indexbg.running)
+    return;
+
+  EnterCriticalSection(&indexbg.lock);
+  indexBuild *pending = indexbg.pending;
+  indexbg.pending = NULL;
+  int lost = pending || indexbg.busy;
+  indexbg.cancel = 1;
+  while (indexbg.busy)
+    SleepConditionVariableCS(&indexbg.idle, &indexbg.lock, INFINITE);
+  indexbg.cancel = 0;
+  indexBuild *done = indexbg.done;
+  indexbg.done = NULL;
+  LeaveCriticalSection(&indexbg.lock);
+
+  if (pending)
+    indexBuildFree(pending);
+  if (done)
+    editorIndexApply(done);
+  else if (lost)
+    editorIndexFromRows();
+}
+
+// Starts over for the rows from first on, just loaded from a file. A mapped
+// file is indexed in the background straight from the mapping.
+void editorIndexOpen(int first, int mapped)
+{
+  if (!trigrams.enabled)
+    return;
+
+  editorIndexCancel();
+  indexListsFree(trigrams.lists);
+  trigrams.lists = NULL;
+  trigrams.rowofvalid = 0;
+  if (!mapped || first > 0 || first == E.numrows)
+  {
+    editorIndexFromRows();
+    return;
+  }
+
+  if (!indexbg.running)
+  {
+    InitializeCriticalSection(&indexbg.lock);
+    InitializeConditionVariable(&indexbg.wake);
+    InitializeConditionVariable(&indexbg.idle);
+    inputWakeInit();
+    HANDLE thread = CreateThread(NULL, 0, editorIndexThread, NULL, 0, NULL);
+    if (thread == NULL)
+      die("CreateThread");
+    CloseHandle(thread);
+    indexbg.running = 1;
+  }
+
+  indexBuild *b = malloc(sizeof(indexBuild));
+  b->buf = E.pt.orig;
+  b->len = E.pt.origlen;
+  b->firstid = editorRowAt(0)->id;
+  b->numrows = E.numrows;
+  b->start = GetTickCount();
+  b->lists = calloc(1 << WILO_INDEX_BITS, sizeof(indexList));
+  // The build covers every row just loaded.
+  trigrams.numdirty = 0;
+
+  EnterCriticalSection(&indexbg.lock);
+  indexbg.pending = b;
+  WakeConditionVariable(&indexbg.wake);
+  LeaveCriticalSection(&indexbg.lock);
+}
+
+void editorIndexIdle()
+{
+  if (!indexbg.running)
+    return;
+
+  EnterCriticalSection(&indexbg.lock);
+  indexBuild *done = indexbg.done;
+  indexbg.done = NULL;
+  LeaveCriticalSection(&indexbg.lock);
+  if (done)
+    editorIndexApply(done);
+}
+
+// Brings the lists and the row of each id up to date.
+void editorIndexFlush()
+{
+  if (!trigrams.rowofvalid)
+  {
+    if (trigrams.rowofcap < trigrams.nextid)
+    {
+      trigrams.rowofcap = trigrams.nextid;
+      trigrams.rowof = realloc(trigrams.rowof, sizeof(int) * trigrams.rowofcap);
+    }
+    memset(trigrams.rowof, 0xff, sizeof(int) * trigrams.nextid);
+    for (int j = 0; j < E.numrows; j++)
+      trigrams.rowof[editorRowAt(j)->id] = j;
+    trigrams.rowofvalid = 1;
+  }
+
+  for (int i = 0; i < trigrams.numdirty; i++)
+  {
+    int at = trigrams.rowof[trigrams.dirty[i]];
+    if (at < 0)
+      continue;
+    erow *row = editorRowAt(at);
+    indexAddText(trigrams.lists, trigrams.dirty[i], row->chars, row->size);
+  }
+  trigrams.numdirty = 0;
+}
+
+int indexCompareRows(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+// Stores the rows that may contain query in *rows, in order, and returns how
+// many there are. Returns -1 when the index cannot narrow the query down: it
+// is off or still building, the query is shorter than a trigram, or its
+// trigrams are in so many blocks that scanning every row is cheaper.
+int editorIndexCandidates(const char *query, int len, int **rows)
+{
+  *rows = NULL;
+  if (trigrams.lists == NULL || len < 3)
+    return -1;
+  editorIndexFlush();
+
+  // The shortest few lists of the query's trigrams, shortest first.
+  indexList *probe[WILO_INDEX_PROBES];
+  int numprobes = 0;
+  unsigned int t = 0;
+  for (int i = 0; i < len; i++)
+  {
+    t = ((t << 8) | searchFoldByte(query[i])) & 0xffffff;
+    if (i < 2)
+      continue;
+    indexList *l = &trigrams.lists[indexBucket(t)];
+    int seen = 0;
+    for (int k = 0; k < numprobes; k++)
+      seen |= probe[k] == l;
+    if (seen)
+      continue;
+    if (numprobes < WILO_INDEX_PROBES)
+      numprobes++;
+    else if (l->count >= probe[numprobes - 1]->count)
+      continue;
+    int k = numprobes - 1;
+    for (; k > 0 && probe[k - 1]->count > l->count; k--)
+      probe[k] = probe[k - 1];
+    probe[k] = l;
+  }
+
+  // A block is a candidate once it is marked by every probe in turn.
+  unsigned int numblocks = (trigrams.nextid + WILO_INDEX_BLOCK - 1) / WILO_INDEX_BLOCK;
+  unsigned char *mark = calloc(numblocks + 1, 1);
+  for (int k = 0; k < numprobes; k++)
+  {
+    for (int i = 0; i < probe[k]->count; i++)
+    {
+      unsigned int b = probe[k]->blocks[i];
+      if (mark[b] == k)
+        mark[b] = k + 1;
+    }
+  }
+
+  unsigned int numcandidates = 0;
+  for (int i = 0; i < probe[0]->count; i++)
+  {
+    unsigned int b = probe[0]->blocks[i];
+    numcandidates += mark[b] == numprobes;
+  }
+  if ((size_t)numcandidates * WILO_INDEX_BLOCK > (size_t)E.numrows / 2)
+  {
+    free(mark);
+    return -1;
+  }
+
+  int count = 0, cap = 0;
+  for (int i = 0; i < probe[0]->count; i++)
+  {
+    unsigned int b = probe[0]->blocks[i];
+    if (mark[b] != numprobes)
+      continue;
+    mark[b] = 0;
+    for (unsigned int id = b * WILO_INDEX_BLOCK; id < (b + 1) * WILO_INDEX_BLOCK && id < trigrams.nextid; id++)
+    {
+      int at = trigrams.rowof[id];
+      if (at < 0)
+        continue;
+      if (count == cap)
+      {
+        cap = cap ? cap * 2 : 64;
+        *rows = realloc(*rows, sizeof(int) * cap);
+      }
+      (*rows)[count++] = at;
+    }
+  }
+  free(mark);
+
+  if (count > 1)
+    qsort(*rows, count, sizeof(int), indexCompareRows);
+  return count;
+}
+
+// Bytes held by the index.
+size_t editorIndexMemory()
+{
+  if (trigrams.lists == NULL)
+    return 0;
+  size_t bytes = sizeof(indexList) << WILO_INDEX_BITS;
+  for (int i = 0; i < (1 << WILO_INDEX_BITS); i++)
+    bytes += sizeof(unsigned int) * trigrams.lists[i].cap;
+  bytes += sizeof(int) * trigrams.rowofcap;
+  bytes += sizeof(unsigned int) * trigrams.dirtycap;
+  return bytes;
+}
+
+/*** append buffer ***/
+
+// The buffer doubles its capacity as it grows. editorRefreshScreen keeps one
+// between frames and only resets its length, so a steady stream of frames
+// does not allocate.
+typedef struct abuf
+{
+  char *b;
+  int len;
+  int cap;
+} abuf;
+
+#define ABUF_INIT \
+  {               \
+    NULL, 0, 0    \
+  }
+
+void abAppend(abuf *ab, const char *s, int len)
+{
+  if (ab->len + len > ab->cap)
+  {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abFree(abuf *ab)
+{
+  free(ab->b);
+}
+
+/*** screen buffer ***/
+
+// Frames are drawn into E.frame and compared with E.shadow, the cells last
+// written to the terminal, so only the cells that changed are sent.
+
+void screenResize(screenBuffer *s, int rows, int cols)
+{
+  if (s->rows == rows && s->cols == cols)
+    return;
+  s->rows = rows;
+  s->cols = cols;
+  s->chars = realloc(s->chars, rows * cols);
+  s->attrs = realloc(s->attrs, rows * cols);
+  E.shadowvalid = 0;
+}
+
+void screenClear(screenBuffer *s)
+{
+  memset(s->chars, ' ', s->rows * s->cols);
+  memset(s->attrs, SCREEN_DEFAULT, s->rows * s->cols);
+}
+
+void screenPut(screenBuffer *s, int y, int x, const char *text, int len, unsigned char attr)
+{
+  if (x + len > s->cols)
+    len = s->cols - x;
+  if (len <= 0)
+    return;
+  memcpy(&s->chars[y * s->cols + x], text, len);
+  memset(&s->attrs[y * s->cols + x], attr, len);
+}
+
+// Writes n in decimal and returns the number of digits. Escapes are built
+// by hand because snprintf dominated the cost of a frame.
+int screenFormatInt(char *buf, int n)
+{
+  char digits[12];
+  int len = 0;
+  do
+  {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  for (int i = 0; i < len; i++)
+    buf[i] = digits[len - 1 - i];
+  return len;
+}
+
+void screenMoveCursor(abuf *ab, int y, int x)
+{
+  char buf[32];
+  int len = 0;
+  buf[len++] = '\x1b';
+  buf[len++] = '[';
+  len += screenFormatInt(&buf[len], y + 1);
+  buf[len++] = ';';
+  len += screenFormatInt(&buf[len], x + 1);
+  buf[len++] = 'H';
+  abAppend(ab, buf, len);
+}
+
+void screenSetAttr(abuf *ab, unsigned char *current, unsigned char attr)
+{
+  if (*current == attr)
+    return;
+
+  char buf[16];
+  int len = 0;
+  buf[len++] = '\x1b';
+  buf[len++] = '[';
+  if ((attr ^ *current) & SCREEN_INVERSE)
+  {
+    if (!(attr & SCREEN_INVERSE))
+      buf[len++] = '2';
+    buf[len++] = '7';
+  }
+  if ((attr ^ *current) & ~SCREEN_INVERSE)
+  {
+    if (len > 2)
+      buf[len++] = ';';
+    len += screenFormatInt(&buf[len], attr & ~SCREEN_INVERSE);
+  }
+  buf[len++] = 'm';
+  abAppend(ab, buf, len);
+  *current = attr;
+}
+
+// Number of frame lines in [0, rows) equal to the shadow line shift below.
+int screenShiftMatches(int rows, int shift)
+{
+  int cols = E.frame.cols;
+  int matches = 0;
+  for (int y = 0; y < rows; y++)
+  {
+    int from = y + shift;
+    if (from < 0 || from >= rows)
+      continue;
+    if (!memcmp(&E.frame.chars[y * cols], &E.shadow.chars[from * cols], cols) &&
+        !memcmp(&E.frame.attrs[y * cols], &E.shadow.attrs[from * cols], cols))
+      matches++;
+  }
+  return matches;
+}
+
+// Scrolls terminal lines [0, rows) by shift lines, up when positive, using a
+// scroll region (DECSTBM) with SU/SD, and moves the shadow lines to match.
+// The lines scrolled in are blank.
+void screenScroll(abuf *ab, int rows, int shift)
+{
+  char buf[48];
+  int len = 0;
+  buf[len++] = '\x1b';
+  buf[len++] = '[';
+  buf[len++] = '1';
+  buf[len++] = ';';
+  len += screenFormatInt(&buf[len], rows);
+  buf[len++] = 'r';
+  buf[len++] = '\x1b';
+  buf[len++] = '[';
+  len += screenFormatInt(&buf[len], shift > 0 ? shift : -shift);
+  buf[len++] = shift > 0 ? 'S' : 'T';
+  memcpy(&buf[len], "\x1b[r", 3);
+  len += 3;
+  abAppend(ab, buf, len);
+
+  int cols = E.shadow.cols;
+  int n = shift > 0 ? shift : -shift;
+  int keep = (rows - n) * cols;
+  int from = shift > 0 ? n * cols : 0;
+  int to = shift > 0 ? 0 : n * cols;
+  int blank = shift > 0 ? keep : 0;
+  memmove(&E.shadow.chars[to], &E.shadow.chars[from], keep);
+  memmove(&E.shadow.attrs[to], &E.shadow.attrs[from], keep);
+  memset(&E.shadow.chars[blank], ' ', n * cols);
+  memset(&E.shadow.attrs[blank], SCREEN_DEFAULT, n * cols);
+}
+
+// Appends the escapes that turn the shadow into the frame, then makes the
+// frame the new shadow.
+void screenFlush(abuf *ab)
+{
+  screenBuffer *f = &E.frame;
+  int valid = E.shadowvalid;
+  unsigned char attr = SCREEN_DEFAULT;
+  int cy = -1, cx = -1;
+
+  for (int y = 0; y < f->rows; y++)
+  {
+    char *chars = &f->chars[y * f->cols];
+    unsigned char *attrs = &f->attrs[y * f->cols];
+    char *oldchars = &E.shadow.chars[y * f->cols];
+    unsigned char *oldattrs = &E.shadow.attrs[y * f->cols];
+
+    if (valid && !memcmp(chars, oldchars, f->cols) && !memcmp(attrs, oldattrs, f->cols))
+      continue;
+
+    // Cells from tail on are blank and can be cleared with one erase.
+    int tail = f->cols;
+    while (tail > 0 && chars[tail - 1] == ' ' && attrs[tail - 1] == SCREEN_DEFAULT)
+      tail--;
+
+    int x = 0;
+    while (x < f->cols)
+    {
+      if (valid && chars[x] == oldchars[x] && attrs[x] == oldattrs[x])
+      {
+        x++;
+        continue;
+      }
+
+      // A run of changed cells, bridging short unchanged gaps.
+      int end = valid ? x + 1 : f->cols;
+      for (int i = end; i < f->cols && i - end < SCREEN_GAP; i++)
+      {
+        if (!valid || chars[i] != oldchars[i] || attrs[i] != oldattrs[i])
+          end = i + 1;
+      }
+
+      if (cy != y || cx != x)
+      {
+        screenMoveCursor(ab, y, x);
+        cy = y;
+        cx = x;
+      }
+
+      int stop = end < tail ? end : tail;
+      while (cx < stop)
+      {
+        int n = 1;
+        while (cx + n < stop && attrs[cx + n] == attrs[cx])
+          n++;
+        screenSetAttr(ab, &attr, attrs[cx]);
+        abAppend(ab, &chars[cx], n);
+        cx += n;
+      }
+      if (end > tail)
+      {
+        screenSetAttr(ab, &attr, SCREEN_DEFAULT);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+      x = end;
+    }
+    // The cursor position is unclear after writing the last column.
+    if (cx >= f->cols)
+      cy = -1;
+  }
+  screenSetAttr(ab, &attr, SCREEN_DEFAULT);
+
+  screenBuffer shown = E.shadow;
+  E.shadow = E.frame;
+  E.frame = shown;
+  E.shadowvalid = 1;
+}
+
+/*** output ***/
+
+void editorScroll()
+{
+  E.rx = 0;
+  if (E.cy < E.numrows)
+  {
+    E.rx = editorRowCxtoRx(editorRowAt(E.cy), E.cx);
+  }
+
+  if (E.cy < E.rowoff)
+  {
+    E.rowoff = E.cy;
+  }
+  if (E.cy >= E.rowoff + E.screenrows)
+  {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
+  if (E.rx < E.coloff)
+  {
+    E.coloff = E.rx;
+  }
+  if (E.rx >= E.coloff + E.screencols)
+  {
+    E.coloff = E.rx - E.screencols + 1;
+  }
+}
+
+// Sizes the row cache to a few screens worth of rows, keyed by row version.
+void editorRowCacheResize(int rows, int cols)
+{
+  rowCache *c = &E.rowcache;
+  int size = 16;
+  while (size < rows * 4)
+    size *= 2;
+  if (c->size == size && c->cols == cols)
+    return;
+
+  for (int i = 0; i < c->size; i++)
+  {
+    free(c->entries[i].chars);
+    free(c->entries[i].attrs);
+  }
+  free(c->entries);
+  c->size = size;
+  c->cols = cols;
+  c->entries = calloc(size, sizeof(rowCacheEntry));
+  for (int i = 0; i < size; i++)
+  {
+    c->entries[i].chars = malloc(cols);
+    c->entries[i].attrs = malloc(cols);
+  }
+}
+
+rowCacheEntry *editorRowCacheSlot(erow *row)
+{
+  return &E.rowcache.entries[(row->version * 2654435761u) & (E.rowcache.size - 1)];
+}
+
+// Copies a row's cached cells into frame line y. Returns 0 on a miss.
+int editorRowCacheGet(erow *row, int y)
+{
+  rowCacheEntry *e = editorRowCacheSlot(row);
+  if (e->version != row->version || e->hl_start != row->hl_start ||
+      e->hlepoch != E.hlepoch || e->coloff != E.coloff)
+  {
+    E.rowcache.misses++;
+    return 0;
+  }
+  memcpy(&E.frame.chars[y * E.frame.cols], e->chars, E.frame.cols);
+  memcpy(&E.frame.attrs[y * E.frame.cols], e->attrs, E.frame.cols);
+  E.rowcache.hits++;
+  return 1;
+}
+
+void editorRowCachePut(erow *row, int y)
+{
+  rowCacheEntry *e = editorRowCacheSlot(row);
+  e->version = row->version;
+  e->hl_start = row->hl_start;
+  e->hlepoch = E.hlepoch;
+  e->coloff = E.coloff;
+  memcpy(e->chars, &E.frame.chars[y * E.frame.cols], E.frame.cols);
+  memcpy(e->attrs, &E.frame.attrs[y * E.frame.cols], E.frame.cols);
+}
+
+void editorDrawRows()
+{
+  // Far below the watermark, draw from the stored states and leave the rows
+  // in between to the background highlighter.
+  int draft = E.rowoff - E.hlvalid > WILO_HL_IDLE_ROWS;
+  int y;
+  for (y = 0; y < E.screenrows; y++)
+  {
+    int filerow = y + E.rowoff;
+    if (filerow >= E.numrows)
+    {
+      screenPut(&E.frame, y, 0, "~", 1, SCREEN_DEFAULT);
+      if (E.numrows == 0 && y == E.screenrows / 3)
+      {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+                                  "Wilo editor -- version %s", WILO_VERSION);
+        if (welcomelen > E.screencols)
+          welcomelen = E.screencols;
+        int padding = (E.screencols - welcomelen) / 2;
+        screenPut(&E.frame, y, padding, welcome, welcomelen, SCREEN_DEFAULT);
+      }
+    }
+    else
+    {
+      erow *row = draft ? editorRowRenderDraft(filerow) : editorRowRender(filerow);
+      int cached = E.match.row != filerow;
+      if (cached && editorRowCacheGet(row, y))
+        continue;
+
+      int len = row->rsize - E.coloff;
+      if (len < 0)
+        len = 0;
+      if (len > E.screencols)
+        len = E.screencols;
+
+      int at = E.coloff;
+      int end = E.coloff + len;
+      int s = editorRowSpanAt(row, at);
+      while (at < end)
+      {
+        // The next run of bytes drawn in one highlight.
+        int hl = HL_NORMAL;
+        int next = end;
+        while (s < row->hlspans && row->hl[s].start + row->hl[s].len <= at)
+          s++;
+        if (s < row->hlspans && row->hl[s].start <= at)
+        {
+          hl = row->hl[s].hl;
+          next = row->hl[s].start + row->hl[s].len;
+        }
+        else if (s < row->hlspans)
+        {
+          next = row->hl[s].start;
+        }
+        if (E.match.row == filerow)
+        {
+          int mend = E.match.start + E.match.len;
+          if (at >= E.match.start && at < mend)
+          {
+            hl = HL_MATCH;
+            next = mend;
+          }
+          else if (E.match.start > at && E.match.start < next)
+          {
+            next = E.match.start;
+          }
+        }
+        if (next > end)
+          next = end;
+
+        unsigned char attr = hl == HL_NORMAL ? SCREEN_DEFAULT : editorSyntaxToColor(hl);
+        if (hl == HL_MATCH)
+          attr |= SCREEN_INVERSE;
+        while (at < next)
+        {
+          char *c = &row->render[at];
+          int n = 0;
+          while (at + n < next && !iscntrl(c[n]))
+            n++;
+          if (n > 0)
+          {
+            screenPut(&E.frame, y, at - E.coloff, c, n, attr);
+            at += n;
+          }
+          else
+          {
+            char sym = (c[0] <= 26) ? '@' + c[0] : '?';
+            screenPut(&E.frame, y, at - E.coloff, &sym, 1, attr | SCREEN_INVERSE);
+            at++;
+          }
+        }
+      }
+      if (cached)
+        editorRowCachePut(row, y);
+    }
+  }
+}
+
+void editorDrawStatusBar()
+{
+  int y = E.screenrows;
+  char status[80], rstatus[80];
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                     E.filename ? E.filename : "[No Name]", E.numrows,
+                     E.dirty ? "(modified)" : "");
+  char matches[40] = "";
+  if (found.active && found.complete && found.query[0])
+  {
+    char *mode = found.regex ? "regex " : "";
+    if (found.error)
+      snprintf(matches, sizeof(matches), "regex: %s | ", found.error);
+    else if (found.count)
+      snprintf(matches, sizeof(matches), "%smatch %d of %d | ", mode, found.current + 1, found.count);
+    else
+      snprintf(matches, sizeof(matches), "%sno matches | ", mode);
+  }
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", matches,
+                      E.syntax ? E.syntax->filetype : "no ft",
+                      E.cy + 1, E.numrows);
+  if (len > E.screencols)
+    len = E.screencols;
+  memset(&E.frame.attrs[y * E.frame.cols], SCREEN_INVERSE | SCREEN_DEFAULT, E.screencols);
+  screenPut(&E.frame, y, 0, status, len, SCREEN_INVERSE | SCREEN_DEFAULT);
+  if (E.screencols - len >= rlen)
+    screenPut(&E.frame, y, E.screencols - rlen, rstatus, rlen, SCREEN_INVERSE | SCREEN_DEFAULT);
+}
+
+void editorDrawMessageBar()
+{
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.screencols)
+    msglen = E.screencols;
+  if (msglen)
+    screenPut(&E.frame, E.screenrows + 1, 0, E.statusmsg, msglen, SCREEN_DEFAULT);
+}
+
+void editorStatusExpire()
+{
+  E.statusmsg[0] = '\0';
+  E.redraw = 1;
+}
+
+void editorSetStatusMessage(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  timerSet(WILO_STATUS_MS, editorStatusExpire);
+}
+
+// Draws the screen into the frame and appends what changed since the last
+// frame, with the cursor hidden while cells are written.
+void editorDrawFrame(abuf *ab)
+{
+  screenResize(&E.frame, E.screenrows + 2, E.screencols);
+  screenResize(&E.shadow, E.screenrows + 2, E.screencols);
+  editorRowCacheResize(E.screenrows, E.screencols);
+  screenClear(&E.frame);
+
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
+  int hide = ab->len;
+  abAppend(ab, "\x1b[?25l", 6);
+  int start = ab->len;
+  // When the view moved vertically, shift what the terminal already shows
+  // and only draw the lines scrolled in.
+  int shift = E.rowoff - E.shadowrowoff;
+  if (E.shadowvalid && shift != 0 && shift > -E.screenrows && shift < E.screenrows &&
+      screenShiftMatches(E.screenrows, shift) > screenShiftMatches(E.screenrows, 0))
+    screenScroll(ab, E.screenrows, shift);
+  screenFlush(ab);
+  E.shadowrowoff = E.rowoff;
+  int changed = ab->len > start;
+  if (!changed)
+    ab->len = hide;
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  abAppend(ab, buf, strlen(buf));
+
+  if (changed)
+    abAppend(ab, "\x1b[?25h", 6);
+}
+
+void editorRefreshScreen()
+{
+  static abuf ab = ABUF_INIT;
+
+  editorScroll();
+
+  ab.len = 0;
+  editorDrawFrame(&ab);
+  termWrite(ab.b, ab.len);
+  E.frametick = GetTickCount();
+}
+
+// Picks up a new console size; the next frame is drawn in full.
+void editorResize()
+{
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
+  E.screenrows -= 2;
+  E.shadowvalid = 0;
+  E.redraw = 1;
+}
+
+void editorClearScreen()
+{
+  abuf ab = ABUF_INIT;
+
+  abAppend(&ab, "\x1b[?25l", 6);
+  abAppend(&ab, "\x1b[H", 3);
+  int rowCount = E.screenrows + 2;
+  for (int y = 0; y < rowCount; y++)
   {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+    abAppend(&ab, "\x1b[K", 3);
+    if (y < rowCount - 1)
+      abAppend(&ab, "\r\n", 2);
   }
+  abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(&ab, "\x1b[H", 3);
 
-  return buf;
+  termWrite(ab.b, ab.len);
+  abFree(&ab);
+  E.shadowvalid = 0;
 }
 
-void editorOpen(char *filename)
+/*** input ***/
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
 {
-  free(E.filename);
-  E.filename = _strdup(filename);
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
 
-  editorSelectSyntaxHighlight();
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1)
+  {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    {
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+    }
+    else if (c == '\x1b')
+    {
+      editorSetStatusMessage("");
+      if (callback)
+        callback(buf, c);
+      free(buf);
+      return NULL;
+    }
+    else if (c == '\r')
+    {
+      if (buflen != 0)
+      {
+        editorSetStatusMessage("");
+        if (callback)
+          callback(buf, c);
+        return buf;
+      }
+    }
+    else if (!iscntrl(c) && c < 128)
+    {
+      if (buflen == bufsize - 1)
+      {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+
+    if (callback)
+      callback(buf, c);
+  }
+}
+
+void editorMoveCursor(int key)
+{
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+
+  switch (key)
+  {
+  case ARROW_LEFT:
+    if (E.cx != 0)
+    {
+      E.cx--;
+    }
+    else if (E.cy > 0)
+    {
+      E.cy--;
+      E.cx = editorRowAt(E.cy)->size;
+    }
+    break;
+  case ARROW_RIGHT:
+    if (row && E.cx < row->size)
+    {
+      E.cx++;
+    }
+    else if (row && E.cx == row->size)
+    {
+      E.cy++;
+      E.cx = 0;
+    }
+    break;
+  case ARROW_UP:
+    if (E.cy != 0)
+    {
+      E.cy--;
+    }
+    break;
+  case ARROW_DOWN:
+    if (E.cy < E.numrows)
+    {
+      E.cy++;
+    }
+    break;
+  }
 
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen)
+  {
+    E.cx = rowlen;
+  }
+}
+
+// Inserts a character pressed several times in a row as one block.
+void editorInsertRepeated(int c, int times)
+{
+  char buf[256];
+  while (times > 0)
+  {
+    int n = times < (int)sizeof(buf) ? times : (int)sizeof(buf);
+    memset(buf, c, n);
+    editorInsertText(buf, n);
+    times -= n;
+  }
+}
+
+void editorProcessKey(int c, int repeat)
+{
+  static int quit_times = WILO_QUIT_TIMES;
+
+  switch (c)
+  {
+  case '\r':
+    editorInsertRepeated('\n', repeat);
+    break;
+  case CTRL_KEY('q'):
+    if (E.dirty && quit_times >= repeat)
+    {
+      quit_times -= repeat;
+      editorSetStatusMessage("WARNING!!! File has unsaved changes."
+                             "Press CTRL-Q %d more times to quit",
+                             quit_times + 1);
+      return;
+    }
+    editorClearScreen();
+    exit(0);
+    break;
+  case CTRL_KEY('s'):
+    editorSave();
+    break;
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+  case END_KEY:
+    if (E.cy < E.numrows)
+      E.cx = editorRowAt(E.cy)->size;
+    break;
+  case CTRL_KEY('f'):
+    editorFind();
+    break;
+  case PASTE_START:
+    editorPaste();
+    break;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    while (repeat--)
+    {
+      if (c == DEL_KEY)
+        editorMoveCursor(ARROW_RIGHT);
+      editorDelChar();
+    }
+    break;
+  case PAGE_UP:
+  case PAGE_DOWN:
+    while (repeat--)
+    {
+      if (c == PAGE_UP)
+      {
+        E.cy = E.rowoff;
+      }
+      else if (c == PAGE_DOWN)
+      {
+        E.cy = E.rowoff + E.screenrows - 1;
+        if (E.cy > E.numrows)
+          E.cy = E.numrows;
+      }
+      int times = E.screenrows;
+      while (times--)
+        editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+      // The next page starts from where this one scrolled to.
+      editorScroll();
+    }
+    break;
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_UP:
+  case ARROW_DOWN:
+    while (repeat--)
+      editorMoveCursor(c);
+    break;
+  case CTRL_KEY('l'):
+    // Repaints every cell, for a terminal whose screen was disturbed.
+    E.shadowvalid = 0;
+    break;
+  case '\x1b':
+  case PASTE_END:
+  case 0:
+    break;
+  default:
+    editorInsertRepeated(c, repeat);
+    break;
+  }
+
+  quit_times = WILO_QUIT_TIMES;
+}
+
+// Handles the next key event, applying all of its repeats at once, and
+// returns the number of key presses it stood for.
+int editorProcessKeyPress()
+{
+  int repeat;
+  int c = editorReadKeyRepeat(&repeat, 0);
+  editorProcessKey(c, repeat);
+  return repeat;
+}
+
+// Handles the next key, then every key that is already queued or arrives
+// before the next frame is due, so a burst costs one redraw instead of one
+// per key. Stops after budget ms so held keys still show up on screen.
+int editorProcessInput(DWORD budget)
+{
+  int keys = editorProcessKeyPress();
+  DWORD first = GetTickCount();
+  while (1)
+  {
+    DWORD now = GetTickCount();
+    DWORD spent = now - first;
+    if (spent >= budget)
+      break;
+    DWORD wait = now - E.frametick < WILO_FRAME_MS ? E.frametick + WILO_FRAME_MS - now : 0;
+    if (wait > budget - spent)
+      wait = budget - spent;
+    if (!inputPending(wait))
+      break;
+    keys += editorProcessKeyPress();
+  }
+  return keys;
+}
+
+/*** benchmarks ***/
+
+#ifdef WILO_BENCH
+
+// Set by benchmarks that check the editor's output, and turned into the
+// exit status.
+int benchFailures = 0;
+
+double benchNow()
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / freq.QuadPart;
+}
+
+void benchFillRows(int numrows)
+{
+  char line[64];
+  for (int i = 0; i < numrows; i++)
+  {
+    int len = snprintf(line, sizeof(line), "%08d: the quick brown fox jumps over the lazy dog", i);
+    editorInsertRow(E.numrows, line, len);
+  }
+}
+
+void benchClearRows()
+{
+  while (E.numrows)
+    editorDelRow(E.numrows - 1);
+  E.dirty = 0;
+}
+
+void benchRows(int argc, char **argv)
+{
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+
+  double start = benchNow();
+  benchFillRows(numrows);
+  printf("fill %d rows: %.1f ms\n", numrows, (benchNow() - start) * 1e3);
+
+  int where[] = {0, numrows / 2, numrows};
+  char *names[] = {"top", "middle", "bottom"};
+  for (int w = 0; w < 3; w++)
+  {
+    start = benchNow();
+    for (int i = 0; i < iterations; i++)
+      editorInsertRow(where[w], "", 0);
+    double insert = benchNow() - start;
+
+    start = benchNow();
+    for (int i = 0; i < iterations; i++)
+      editorDelRow(where[w]);
+    double delete = benchNow() - start;
+
+    printf("%-6s insert: %.3f us/row, delete: %.3f us/row\n", names[w],
+           insert * 1e6 / iterations, delete * 1e6 / iterations);
+  }
+
+  // Alternate between both ends so every insert has to move the whole gap.
+  start = benchNow();
+  for (int i = 0; i < iterations / 100; i++)
+    editorInsertRow((i & 1) ? E.numrows : 0, "", 0);
+  printf("worst  insert: %.3f us/row\n", (benchNow() - start) * 1e6 / (iterations / 100));
+
+  benchClearRows();
+}
+
+void benchWriteFile(char *filename, int numrows)
+{
   FILE *fp = NULL;
-  fopen_s(&fp, filename, "r");
+  fopen_s(&fp, filename, "wb");
   if (!fp)
     die("fopen");
+  for (int i = 0; i < numrows; i++)
+    fprintf(fp, "%08d: the quick brown fox jumps over the lazy dog\n", i);
+  fclose(fp);
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  size_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+void benchWriteSource(char *filename, int numrows, int blockcomments)
+{
+  static char *lines[] = {
+      "/* generated by the wilo benchmarks",
+      " * block comments span several rows */",
+      "static int table_%d[] = {1, 2, 3, 0x40, 3.25};",
+      "int function_%d(char *s, unsigned long n)",
+      "{",
+      "\tif (s[n] == '\\'' || strcmp(s, \"%d: \\\"quoted\\\"\") == 0) // compare",
+      "\t\treturn helper(s, n + %d);",
+      "\tfor (int i = 0; i < n; i++) { total += i * 2; }",
+      "}",
+  };
+  int count = sizeof(lines) / sizeof(lines[0]);
+
+  FILE *fp = NULL;
+  fopen_s(&fp, filename, "wb");
+  if (!fp)
+    die("fopen");
+  for (int i = 0; i < numrows; i++)
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
+    int line = i % count;
+    if (!blockcomments && line < 2)
+      line += 2;
+    fprintf(fp, lines[line], i);
+    fputc('\n', fp);
+  }
+  fclose(fp);
+}
 
-    editorInsertRow(E.numrows, line, linelen);
+void benchReportMemory(char *label)
+{
+  size_t chars = 0, render = 0;
+  for (int j = 0; j < E.numrows; j++)
+  {
+    erow *row = editorRowAt(j);
+    if (editorRowOwnsChars(row))
+      chars += row->size + 1;
+    render += row->render ? row->rsize + 1 : 0;
+    render += sizeof(hlSpan) * row->hlspans;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  chars += E.pt.addlen;
+  printf("%-22s text %10zu B, render+spans %10zu B, row table %10zu B\n", label,
+         chars, render, sizeof(erow) * E.rowcap);
 }
 
-void editorSave()
+void benchPiece(int argc, char **argv)
 {
-  if (E.filename == NULL)
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  int edits = argc > 1 ? atoi(argv[1]) : 100000;
+  char *filename = "wilo_bench_piece.txt";
+  benchWriteFile(filename, numrows);
+
+  for (int mode = 0; mode < 2; mode++)
   {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL)
+    E.piecetable = mode;
+    double start = benchNow();
+    editorOpen(filename);
+    printf("%s open: %.1f ms\n", mode ? "piece" : "heap ", (benchNow() - start) * 1e3);
+    benchReportMemory(mode ? "piece after open" : "heap after open");
+
+    srand(1);
+    start = benchNow();
+    for (int i = 0; i < edits; i++)
     {
-      editorSetStatusMessage("Save aborted");
-      return;
+      // Runs of typing on a few lines, like a user moving around the file.
+      int at = (i / 100) * 7919 % E.numrows;
+      erow *row = editorRowAt(at);
+      if (rand() % 4)
+        editorRowInsertChar(row, row->size, 'a' + i % 26);
+      else
+        editorRowDelChar(row, row->size / 2);
     }
-    editorSelectSyntaxHighlight();
+    printf("%s edits: %.3f us/edit\n", mode ? "piece" : "heap ", (benchNow() - start) * 1e6 / edits);
+    benchReportMemory(mode ? "piece after edits" : "heap after edits");
+
+    benchClearRows();
+    pieceFree();
   }
+  E.piecetable = 0;
+  remove(filename);
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
+void benchOpen(int argc, char **argv)
+{
+  int numrows = argc > 0 ? atoi(argv[0]) : 2000000;
+  char *filename = "wilo_bench_open.txt";
+  benchWriteFile(filename, numrows);
 
-#if 0
-  FILE *fp = NULL;
-  fopen_s(&fp, E.filename, "w");
-  fprintf_s(fp, buf, len);
-  fclose(fp);
-  free(buf);
-#else
-  if (writeFile(E.filename, buf, len) == len)
+  for (int mapped = 0; mapped < 2; mapped++)
   {
-    editorSetStatusMessage("%d bytes written to disk", len);
-    E.dirty = 0;
-    return;
+    double start = benchNow();
+    if (mapped)
+      editorOpenMapped(filename);
+    else
+      editorOpenStream(filename);
+    double elapsed = benchNow() - start;
+
+    size_t bytes = 0;
+    for (int j = 0; j < E.numrows; j++)
+      bytes += editorRowAt(j)->size + 1;
+    printf("%-7s open: %8.1f ms, %7.1f MB/s, %d rows\n", mapped ? "mapped" : "getline",
+           elapsed * 1e3, bytes / elapsed / 1e6, E.numrows);
+    benchReportMemory(mapped ? "mapped" : "getline");
+
+    benchClearRows();
+    pieceFree();
   }
-  char msg[1024];
-  int code = GetLastErrorAsString(msg, sizeof(msg));
-  if (code == 0)
-    strcpy_s(msg, 1024, "Unknown error");
-  editorSetStatusMessage("Can't save! I/O error: %s", msg);
-#endif
+  remove(filename);
 }
 
-/*** find ***/
-
-void editorFindCallback(char *query, int key)
+void benchLazy(int argc, char **argv)
 {
-  static int last_match = -1;
-  static int direction = 1;
-
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_lazy.c";
+  benchWriteSource(filename, numrows, 1);
+  int screenrows = 60;
 
-  if (saved_hl)
+  for (int eager = 0; eager < 2; eager++)
   {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+    double start = benchNow();
+    editorOpen(filename);
+    int upto = eager ? E.numrows : screenrows;
+    for (int y = 0; y < upto && y < E.numrows; y++)
+      editorRowRender(y);
+    printf("%s first frame: %8.1f ms\n", eager ? "eager" : "lazy ", (benchNow() - start) * 1e3);
+    benchReportMemory(eager ? "eager" : "lazy");
+
+    if (!eager)
+    {
+      start = benchNow();
+      for (int y = E.numrows - screenrows; y < E.numrows; y++)
+        editorRowRender(y);
+      printf("lazy  jump to end:   %8.1f ms\n", (benchNow() - start) * 1e3);
+
+      editorRowInsertChar(editorRowAt(0), 0, ' ');
+      start = benchNow();
+      for (int y = E.numrows - screenrows; y < E.numrows; y++)
+        editorRowRender(y);
+      printf("lazy  edit, redraw end: %5.1f ms\n", (benchNow() - start) * 1e3);
+    }
 
-  if (key == '\r' || key == '\x1b')
-  {
-    last_match = -1;
-    return;
-  }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-  {
-    direction = 1;
-  }
-  else if (key == ARROW_LEFT || key == ARROW_UP)
-  {
-    direction = -1;
+    benchClearRows();
+    pieceFree();
   }
-  else
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+void benchCascade(int argc, char **argv)
+{
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_cascade.c";
+  benchWriteSource(filename, numrows, 0);
+  int screenrows = 60;
+
+  editorOpen(filename);
+  editorResolveSyntax(E.numrows);
+
+  char *steps[] = {"type '/*' on line 1", "type '*/' after it"};
+  for (int step = 0; step < 2; step++)
   {
-    last_match = -1;
-    direction = 1;
+    erow *row = editorRowAt(0);
+    editorRowInsertChar(row, step * 2, step ? '*' : '/');
+    editorRowInsertChar(row, step * 2 + 1, step ? '/' : '*');
+
+    double start = benchNow();
+    for (int y = 0; y < screenrows; y++)
+      editorRowRender(y);
+    double visible = benchNow() - start;
+
+    start = benchNow();
+    while (editorSyntaxIdle())
+      Sleep(1);
+    double idle = benchNow() - start;
+
+    printf("%s: visible rows %.3f ms, rest in the background %.1f ms\n",
+           steps[step], visible * 1e3, idle * 1e3);
   }
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++)
-  {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
 
-    erow *row = &E.row[current];
-    // TODO: Make case insensitive
-    char *match = strstr(row->render, query);
-    if (match)
+double benchHighlight(char *filename, int passes)
+{
+  editorOpen(filename);
+  size_t bytes = 0;
+  double start = benchNow();
+  for (int pass = 0; pass < passes; pass++)
+  {
+    for (int y = 0; y < E.numrows; y++)
     {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+      erow *row = editorRowRender(y);
+      bytes += row->rsize;
+      row->stale = 1;
     }
+    E.hlvalid = 0;
   }
+  double elapsed = benchNow() - start;
+  benchClearRows();
+  pieceFree();
+  return bytes / elapsed / 1e6;
 }
 
-void editorFind()
+void benchKeywords(int argc, char **argv)
 {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+  int numrows = argc > 0 ? atoi(argv[0]) : 200000;
+  int numkeywords = argc > 1 ? atoi(argv[1]) : 500;
+  char *filename = "wilo_bench_keywords.c";
+  benchWriteSource(filename, numrows, 1);
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-  if (query)
+  printf("%4d keywords: %7.1f MB/s\n", 24, benchHighlight(filename, 3));
+
+  // Same file, with a large generated keyword set in front of the C keywords.
+  char **keywords = malloc(sizeof(char *) * (numkeywords + 25));
+  int n = 0;
+  for (; n < numkeywords; n++)
   {
-    free(query);
+    // Room for "kw", any int, "_x|" and the terminator.
+    keywords[n] = malloc(24);
+    snprintf(keywords[n], 24, "kw%d_%s", n, (n & 1) ? "x|" : "y");
   }
-  else
+  for (int j = 0; C_HL_keywords[j]; j++)
+    keywords[n++] = C_HL_keywords[j];
+  keywords[n] = NULL;
+
+  editorSyntax saved = HLDB[0];
+  HLDB[0].keywords = keywords;
+  HLDB[0].tables = NULL;
+  printf("%4d keywords: %7.1f MB/s\n", n, benchHighlight(filename, 3));
+  editorSyntaxFree(HLDB[0].tables);
+  HLDB[0] = saved;
+  for (int j = 0; j < numkeywords; j++)
+    free(keywords[j]);
+  free(keywords);
+
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+// Appends random lines built from syntax fragments, with unbalanced comment
+// and string delimiters.
+void benchAppendFragments(char *filename, int numrows)
+{
+  FILE *fp = fopen(filename, "a");
+  char *frags[] = {"if", "int", "while", "return", "struct", " ", "(", ")", "/*", "*/", "//", "\"", "'", "\\",
+                   "1", "2.5", ".", "x", "foo", "_bar", "!", ",", "\xc3\xa9", "\t", "unsigned", "0x1f", "*", "/", ";"};
+  int numfrags = sizeof(frags) / sizeof(frags[0]);
+  srand(1);
+  for (int j = 0; j < numrows; j++)
   {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    int parts = rand() % 24;
+    for (int k = 0; k < parts; k++)
+      fputs(frags[rand() % numfrags], fp);
+    fputc('\n', fp);
   }
+  fclose(fp);
 }
 
-/*** append buffer ***/
+// The lexer without its state table: every byte goes through editorSyntaxStep.
+int benchSyntaxHighlightStep(char *render, int rsize, unsigned char *hl, int in_comment)
+{
+  memset(hl, HL_NORMAL, rsize);
+  editorLexer lx = {in_comment, 0, 1};
+  int i = 0;
+  while (i < rsize)
+    i = editorSyntaxStep(E.syntax, render, rsize, hl, i, &lx);
+  return lx.in_comment;
+}
 
-typedef struct abuf
+void benchLexer(int argc, char **argv)
 {
-  char *b;
-  int len;
-} abuf;
+  int numrows = argc > 0 ? atoi(argv[0]) : 200000;
+  int passes = argc > 1 ? atoi(argv[1]) : 5;
+  char *filename = "wilo_bench_lexer.c";
+  benchWriteSource(filename, numrows, 1);
+
+  benchAppendFragments(filename, numrows / 4);
+
+  editorOpen(filename);
+  editorResolveSyntax(E.numrows);
+
+  size_t bytes = 0;
+  int mismatches = 0;
+  unsigned char *hl = NULL;
+  unsigned char *ref = NULL;
+  int hlcap = 0;
+  for (int y = 0; y < E.numrows; y++)
+  {
+    erow *row = editorRowRender(y);
+    if (row->rsize > hlcap)
+    {
+      hlcap = row->rsize * 2;
+      hl = realloc(hl, hlcap);
+      ref = realloc(ref, hlcap);
+    }
+    int end = benchSyntaxHighlightStep(row->render, row->rsize, ref, row->hl_start);
+    if (end != editorSyntaxHighlight(E.syntax, row->render, row->rsize, hl, row->hl_start) ||
+        end != row->hl_open_comment || memcmp(hl, ref, row->rsize))
+      mismatches++;
+    bytes += row->rsize;
+  }
+  printf("corpus: %d rows, %.1f MB, %d mismatching rows\n", E.numrows, bytes / 1e6, mismatches);
 
-#define ABUF_INIT \
-  {               \
-    NULL, 0       \
+  for (int table = 0; table < 2; table++)
+  {
+    double start = benchNow();
+    for (int pass = 0; pass < passes; pass++)
+    {
+      for (int y = 0; y < E.numrows; y++)
+      {
+        erow *row = editorRowAt(y);
+        if (table)
+          editorSyntaxHighlight(E.syntax, row->render, row->rsize, hl, row->hl_start);
+        else
+          benchSyntaxHighlightStep(row->render, row->rsize, hl, row->hl_start);
+      }
+    }
+    double elapsed = benchNow() - start;
+    printf("%s: %7.1f MB/s\n", table ? "table lexer" : "per-byte   ", bytes * passes / elapsed / 1e6);
   }
 
-void abAppend(abuf *ab, const char *s, int len)
+  free(hl);
+  free(ref);
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+void benchSpans(int argc, char **argv)
 {
-  char *new = realloc(ab->b, ab->len + len);
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_spans.c";
+  benchWriteSource(filename, numrows, 1);
+
+  editorOpen(filename);
+  size_t render = 0, spans = 0;
+  int numspans = 0;
+  for (int y = 0; y < E.numrows; y++)
+  {
+    erow *row = editorRowRender(y);
+    render += row->rsize;
+    spans += sizeof(hlSpan) * row->hlspans;
+    numspans += row->hlspans;
+  }
+  printf("%d rows, %.1f spans/row\n", E.numrows, (double)numspans / E.numrows);
+  printf("render        %6.1f B/row\n", (double)render / E.numrows);
+  printf("per-byte hl   %6.1f B/row\n", (double)render / E.numrows);
+  printf("hl spans      %6.1f B/row\n", (double)spans / E.numrows);
 
-  if (new == NULL)
-    return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
 }
 
-void abFree(abuf *ab)
+void benchParallel(int argc, char **argv)
 {
-  free(ab->b);
-}
+  int numrows = argc > 0 ? atoi(argv[0]) : 2000000;
+  char *filename = "wilo_bench_parallel.c";
+  benchWriteSource(filename, numrows, 1);
+  benchAppendFragments(filename, numrows / 4);
+
+  editorOpen(filename);
+  for (int y = 0; y < E.numrows; y++)
+    editorRowRender(y);
+
+  for (int y = 0; y < E.numrows; y++)
+    editorRowAt(y)->stale = 1;
+  E.hlvalid = 0;
+  double start = benchNow();
+  editorResolveSyntax(E.numrows);
+  double sequential = benchNow() - start;
+
+  int *states = malloc(sizeof(int) * E.numrows);
+  int *numspans = malloc(sizeof(int) * E.numrows);
+  hlSpan **spans = malloc(sizeof(hlSpan *) * E.numrows);
+  for (int y = 0; y < E.numrows; y++)
+  {
+    erow *row = editorRowAt(y);
+    states[y] = row->hl_start | row->hl_open_comment << 1;
+    numspans[y] = row->hlspans;
+    spans[y] = NULL;
+    // An empty row has no spans and may have no span array at all.
+    if (row->hlspans)
+    {
+      spans[y] = malloc(sizeof(hlSpan) * row->hlspans);
+      memcpy(spans[y], row->hl, sizeof(hlSpan) * row->hlspans);
+    }
+  }
 
-/*** output ***/
+  for (int y = 0; y < E.numrows; y++)
+    editorRowAt(y)->stale = 1;
+  E.hlvalid = 0;
+  start = benchNow();
+  editorSyntaxParallel();
+  double parallel = benchNow() - start;
 
-void editorScroll()
+  int mismatches = 0;
+  for (int y = 0; y < E.numrows; y++)
+  {
+    erow *row = editorRowAt(y);
+    if (row->stale || states[y] != (row->hl_start | row->hl_open_comment << 1) ||
+        numspans[y] != row->hlspans || (row->hlspans && memcmp(spans[y], row->hl, sizeof(hlSpan) * row->hlspans)))
+      mismatches++;
+    free(spans[y]);
+  }
+  printf("%d rows, %d workers, %d mismatching rows\n", E.numrows, poolSize(), mismatches);
+  printf("sequential: %8.1f ms\n", sequential * 1e3);
+  printf("parallel:   %8.1f ms\n", parallel * 1e3);
+
+  free(spans);
+  free(numspans);
+  free(states);
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+void benchTyping(int argc, char **argv)
 {
-  E.rx = 0;
-  if (E.cy < E.numrows)
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  int keys = argc > 1 ? atoi(argv[1]) : 2000;
+  char *filename = "wilo_bench_typing.c";
+  benchWriteSource(filename, numrows, 1);
+
+  editorOpen(filename);
+  E.screenrows = 60;
+  E.screencols = 120;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.cy = 0;
+  E.cx = 0;
+  while (editorSyntaxIdle())
+    Sleep(1);
+  E.hldiscarded = 0;
+
+  // Typing "/*" and "*/" pairs at the top flips the comment state of the
+  // whole file on every other pair.
+  char *text = "/* x */ ";
+  double total = 0, worst = 0;
+  for (int k = 0; k < keys; k++)
   {
-    E.rx = editorRowCxtoRx(&E.row[E.cy], E.cx);
+    double start = benchNow();
+    editorInsertChar(text[k % 8]);
+    abuf ab = ABUF_INIT;
+    editorScroll();
+    editorDrawFrame(&ab);
+    editorSyntaxIdle();
+    double elapsed = benchNow() - start;
+    abFree(&ab);
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+    Sleep(1);
   }
+  double start = benchNow();
+  while (editorSyntaxIdle())
+    Sleep(1);
+  double settle = benchNow() - start;
+
+  printf("%d rows, %d keys: %.3f ms avg, %.3f ms worst per key\n", E.numrows, keys,
+         total * 1e3 / keys, worst * 1e3);
+  printf("background settled %.1f ms after the last key, %lu stale results discarded\n",
+         settle * 1e3, E.hldiscarded);
+
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
 
-  if (E.cy < E.rowoff)
+void benchPaste(int argc, char **argv)
+{
+  int lines = argc > 0 ? atoi(argv[0]) : 10000;
+  char *filename = "wilo_bench_paste.c";
+  char *clipname = "wilo_bench_clip.c";
+  benchWriteSource(filename, 20000, 1);
+  benchWriteSource(clipname, lines, 1);
+  size_t cliplen;
+  char *clip = mapFile(clipname, &cliplen);
+  if (clip == NULL)
+    die("mapFile");
+
+  for (int bulk = 0; bulk < 2; bulk++)
   {
-    E.rowoff = E.cy;
+    editorOpen(filename);
+    E.screenrows = 58;
+    E.screencols = 200;
+    E.rowoff = E.coloff = 0;
+    E.cy = 10000;
+    E.cx = 4;
+
+    double start = benchNow();
+    if (bulk)
+    {
+      editorInsertText(clip, cliplen);
+    }
+    else
+    {
+      for (size_t i = 0; i < cliplen; i++)
+      {
+        if (clip[i] == '\n')
+          editorInsertText("\n", 1);
+        else
+          editorInsertChar(clip[i]);
+      }
+    }
+    double insert = benchNow() - start;
+
+    start = benchNow();
+    abuf ab = ABUF_INIT;
+    editorScroll();
+    editorDrawFrame(&ab);
+    abFree(&ab);
+    double frame = benchNow() - start;
+    printf("%s paste %d lines: %8.1f ms insert, %5.1f ms first frame\n", bulk ? "bulk    " : "per char",
+           lines, insert * 1e3, frame * 1e3);
+
+    benchClearRows();
+    pieceFree();
+    free(E.filename);
+    E.filename = NULL;
+    E.syntax = NULL;
   }
-  if (E.cy >= E.rowoff + E.screenrows)
+
+  unmapFile(clip, cliplen);
+  remove(filename);
+  remove(clipname);
+
+  // A line break typed or pasted past the last row only ends that row.
+  E.cx = E.cy = 0;
+  editorProcessKey('\r', 1);
+  int enterrows = E.numrows, entercy = E.cy;
+  benchClearRows();
+  E.cx = E.cy = 0;
+  editorInsertText("\nab", 3);
+  printf("at eof: enter %d rows, cursor row %d; paste \"\\nab\" %d rows, cursor %d,%d\n",
+         enterrows, entercy, E.numrows, E.cy, E.cx);
+  if (enterrows != 1 || entercy != 1 || E.numrows != 2 || E.cy != 1 || E.cx != 2)
+    benchFailures++;
+  benchClearRows();
+  E.cx = E.cy = 0;
+}
+
+// Replays a fixed mix of typing and cursor movement on a highlighted file
+// and returns the average number of bytes written to the terminal per key.
+double benchKeystrokes(char *filename, int keys, int full, double *elapsed)
+{
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  E.shadowvalid = 0;
+  E.statusmsg[0] = '\0';
+
+  char *text = "total += count;";
+  size_t bytes = 0;
+  for (int k = 0; k < keys; k++)
   {
-    E.rowoff = E.cy - E.screenrows + 1;
+    int step = k % 40;
+    if (step < 15)
+      editorInsertChar(text[step]);
+    else if (step < 30)
+      editorMoveCursor(ARROW_LEFT);
+    else if (step < 38)
+      editorMoveCursor(ARROW_DOWN);
+    else
+      editorMoveCursor(ARROW_RIGHT);
+
+    if (full)
+      E.shadowvalid = 0;
+    abuf ab = ABUF_INIT;
+    double start = benchNow();
+    editorScroll();
+    editorDrawFrame(&ab);
+    *elapsed += benchNow() - start;
+    bytes += ab.len;
+    abFree(&ab);
   }
-  if (E.rx < E.coloff)
+  benchClearRows();
+  pieceFree();
+  return (double)bytes / keys;
+}
+
+void benchScreen(int argc, char **argv)
+{
+  int keys = argc > 0 ? atoi(argv[0]) : 2000;
+  char *filename = "wilo_bench_screen.c";
+  benchWriteSource(filename, 20000, 1);
+
+  printf("200x60 screen, %d keys\n", keys);
+  for (int full = 1; full >= 0; full--)
   {
-    E.coloff = E.rx;
+    double elapsed = 0;
+    E.rowcache.hits = E.rowcache.misses = 0;
+    double bytes = benchKeystrokes(filename, keys, full, &elapsed);
+    printf("%s %8.1f bytes/key, %6.1f us/frame, row cache %lu hits, %lu misses\n",
+           full ? "full redraw:" : "diff:       ", bytes, elapsed * 1e6 / keys,
+           E.rowcache.hits, E.rowcache.misses);
   }
-  if (E.rx >= E.coloff + E.screencols)
+
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+// Queues keys the way one console read delivers them: a full batch of 64
+// records, taken round robin from the escape sequences in seq.
+void benchQueueKeys(char **seq, int numseq)
+{
+  for (int i = 0; i < 64; i++)
   {
-    E.coloff = E.rx - E.screencols + 1;
+    char *s = seq[i % numseq];
+    inputDecodeBytes(s, strlen(s));
   }
 }
 
-void editorDrawRows(abuf *ab)
+void benchInput(int argc, char **argv)
 {
-  int y;
-  for (y = 0; y < E.screenrows; y++)
+  int keys = argc > 0 ? atoi(argv[0]) : 20000;
+  char *filename = "wilo_bench_input.c";
+  benchWriteSource(filename, 20000, 1);
+
+  char *held[] = {"\x1b[B", "x", "a", "b"};
+  int numheld[] = {1, 1, 2};
+  char *names[] = {"arrow down", "typing x  ", "typing ab "};
+  for (int batched = 0; batched < 2; batched++)
   {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows)
-    {
-      if (E.numrows == 0 && y == E.screenrows / 3)
-      {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-                                  "Wilo editor -- version %s", WILO_VERSION);
-        if (welcomelen > E.screencols)
-          welcomelen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding)
-        {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-        {
-          abAppend(ab, " ", 1);
-        }
-        abAppend(ab, welcome, welcomelen);
-      }
-      else
-      {
-        abAppend(ab, "~", 1);
-      }
-    }
-    else
+    for (int k = 0, first = 0; k < 3; first += numheld[k++])
     {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int current_color_inverted = 0;
-      int j;
-      for (j = 0; j < len; j++)
+      editorOpen(filename);
+      E.screenrows = 58;
+      E.screencols = 200;
+      E.cx = E.cy = E.rowoff = E.coloff = 0;
+      E.shadowvalid = 0;
+      E.statusmsg[0] = '\0';
+      editorRefreshScreen();
+
+      int done = 0, frames = 0;
+      double start = benchNow();
+      while (done < keys)
       {
-        if (iscntrl(c[j]))
-        {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1)
-          {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        }
-        else if (hl[j] == HL_NORMAL)
+        if (input.head == input.tail)
+          benchQueueKeys(&held[first], numheld[k]);
+        if (batched)
         {
-          if (current_color_inverted)
-          {
-            current_color_inverted = 0;
-            abAppend(ab, "\x1b[m", 3);
-          }
-          if (current_color != -1)
-          {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          // Pretend the next frame is already due so only queued keys are coalesced.
+          E.frametick = GetTickCount() - WILO_FRAME_MS;
+          done += editorProcessInput(WILO_INPUT_BUDGET_MS);
         }
         else
         {
-          if (hl[j] == HL_MATCH && !current_color_inverted)
-          {
-            current_color_inverted = 1;
-            abAppend(ab, "\x1b[7m", 4);
-          }
-          else if (hl[j] != HL_MATCH && current_color_inverted)
-          {
-            current_color_inverted = 0;
-            abAppend(ab, "\x1b[m", 3);
-          }
-          int color = editorSyntaxToColor(hl[j]);
-          if (current_color != color)
-          {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          int repeat;
+          editorProcessKey(editorReadKeyRepeat(&repeat, 1), 1);
+          done++;
         }
+        editorRefreshScreen();
+        frames++;
       }
-      abAppend(ab, "\x1b[39m", 5);
+      double elapsed = benchNow() - start;
+      printf("%s %s: %9.0f keys/s, %5.1f keys/frame\n", batched ? "batched" : "per key",
+             names[k], done / elapsed, (double)done / frames);
+
+      benchClearRows();
+      pieceFree();
+      free(E.filename);
+      E.filename = NULL;
+      E.syntax = NULL;
+      E.dirty = 0;
     }
-
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
+  input.head = input.tail = 0;
+  remove(filename);
 }
 
-void editorDrawStatusBar(abuf *ab)
+// Runs the idle loop of editorReadKeyRepeat until done reports that the
+// work is finished, and returns the number of times the wait woke up.
+int benchIdleUntil(int (*done)())
 {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                      E.syntax ? E.syntax->filetype : "no ft",
-                      E.cy + 1, E.numrows);
-  if (len > E.screencols)
-    len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols)
+  int wakeups = 0;
+  editorIdle();
+  while (!done())
   {
-    if (E.screencols - len == rlen)
-    {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-    else
-    {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+    inputWait(timerNext());
+    wakeups++;
+    editorIdle();
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  return wakeups;
 }
 
-void editorDrawMessageBar(abuf *ab)
+int benchHighlightDone()
 {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  return E.hlvalid >= E.numrows;
 }
 
-void editorSetStatusMessage(const char *fmt, ...)
+int benchStatusDone()
 {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+  return E.statusmsg[0] == '\0';
+}
+
+void benchIdle(int argc, char **argv)
+{
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_idle.c";
+  benchWriteSource(filename, numrows, 1);
+
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  E.shadowvalid = 0;
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+
+  double start = benchNow();
+  int wakeups = benchIdleUntil(benchHighlightDone);
+  double elapsed = benchNow() - start;
+  printf("background highlight of %d rows: %6.1f ms, %5d wakeups (%d polling every 1 ms)\n",
+         numrows, elapsed * 1e3, wakeups, (int)(elapsed * 1e3));
+
+  start = benchNow();
+  wakeups = benchIdleUntil(benchStatusDone);
+  elapsed = benchNow() - start;
+  printf("idle until the status message expired: %4.1f s, %5d wakeups (%d polling every 100 ms)\n",
+         elapsed, wakeups, (int)(elapsed * 10));
+
+  // A job carries its own syntax; the main thread may clear E.syntax while a
+  // worker highlights, as saving under a name with no filetype does.
+  char text[] = "int x; /* open";
+  hlJobRow jr = {0, 0, sizeof(text) - 1, 1, 0, 0, 0};
+  hlJob job = {E.syntax, 0, 0, 1, 0, &jr, text};
+  hlScratch scratch = {NULL, NULL, 0};
+  E.syntax = NULL;
+  editorHighlightJob(&job, &scratch);
+  printf("job with E.syntax cleared: row ends %s\n", jr.end ? "in a comment" : "outside a comment");
+  if (!jr.end)
+    benchFailures++;
+  free(scratch.render);
+  free(scratch.hl);
+
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
 }
 
-void editorRefreshScreen()
+void benchScroll(int argc, char **argv)
 {
-  editorScroll();
+  int keys = argc > 0 ? atoi(argv[0]) : 5000;
+  char *filename = "wilo_bench_scroll.c";
+  benchWriteSource(filename, 20000, 1);
+
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  E.shadowvalid = 0;
+  E.statusmsg[0] = '\0';
 
   abuf ab = ABUF_INIT;
+  int keycodes[] = {ARROW_DOWN, ARROW_UP};
+  for (int k = 0; k < 2; k++)
+  {
+    size_t bytes = 0;
+    double elapsed = 0;
+    for (int i = 0; i < keys; i++)
+    {
+      editorMoveCursor(keycodes[k]);
+      double start = benchNow();
+      ab.len = 0;
+      editorScroll();
+      editorDrawFrame(&ab);
+      elapsed += benchNow() - start;
+      bytes += ab.len;
+    }
+    printf("hold %s: %7.1f bytes/key, %5.1f us/frame\n", k ? "arrow up  " : "arrow down",
+           (double)bytes / keys, elapsed * 1e6 / keys);
+  }
+  abFree(&ab);
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+void benchFrame(int argc, char **argv)
+{
+  int frames = argc > 0 ? atoi(argv[0]) : 2000;
+  char *filename = "wilo_bench_frame.c";
+  benchWriteSource(filename, 20000, 1);
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  for (int y = 0; y < E.numrows; y++)
+    editorRowRender(y);
 
-  write(ab.b, ab.len);
+  abuf ab = ABUF_INIT;
+  for (int full = 1; full >= 0; full--)
+  {
+    size_t bytes = 0;
+    double start = benchNow();
+    for (int k = 0; k < frames; k++)
+    {
+      // Scroll through the file so every frame is different.
+      E.rowoff = (k * 7) % (E.numrows - E.screenrows);
+      E.cy = E.rowoff;
+      if (full)
+        E.shadowvalid = 0;
+      ab.len = 0;
+      editorDrawFrame(&ab);
+      bytes += ab.len;
+    }
+    double elapsed = benchNow() - start;
+    printf("%s frame: %7.1f us, %7.0f bytes\n", full ? "full" : "diff",
+           elapsed * 1e6 / frames, (double)bytes / frames);
+  }
+  printf("append buffer capacity %d bytes\n", ab.cap);
   abFree(&ab);
+
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
 }
 
-void editorClearScreen()
+// Number of cells of the virtual terminal that differ from the shadow frame,
+// counting a misplaced or hidden cursor as one more.
+int benchVtMismatches()
 {
-  abuf ab = ABUF_INIT;
+  int cells = vt.grid.rows * vt.grid.cols;
+  int bad = 0;
+  if (E.shadow.rows != vt.grid.rows || E.shadow.cols != vt.grid.cols)
+    return cells;
+  for (int i = 0; i < cells; i++)
+  {
+    if (vt.grid.chars[i] != E.shadow.chars[i] || vt.grid.attrs[i] != E.shadow.attrs[i])
+      bad++;
+  }
+  if (vt.cy != E.cy - E.rowoff || vt.cx != E.rx - E.coloff || !vt.cursorvisible)
+    bad++;
+  return bad;
+}
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-  int rowCount = E.screenrows + 2;
-  for (int y = 0; y < rowCount; y++)
+// Runs scripted sessions through the virtual terminal: every read goes
+// through the input decoder and editorProcessInput, every frame through
+// editorRefreshScreen, and the decoded screen must match the shadow frame
+// after each one.
+void benchVt(int argc, char **argv)
+{
+  int sessions = argc > 0 ? atoi(argv[0]) : 200;
+  char *filename = "wilo_bench_vt.c";
+  benchWriteSource(filename, 20000, 1);
+
+  // One entry per read. Held keys arrive several to a read.
+  static char *session[] = {
+      "\x1b[6~", "\x1b[6~", "\x1b[B\x1b[B\x1b[B\x1b[B", "\x1b[F", "x = 1;", "\r",
+      "\x1b[200~/* pasted\r\n * block */\r\n\x1b[201~", "\x1b[A\x1b[A", "\x1b[H", "\x1b[C\x1b[C\x1b[C",
+      "\x7f\x7f", "\x1b[3~", "\x06", "t", "otal", "\x1b[B", "\r", "\x1b[5~",
+      "\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B", "\x1bOF", "\x1b[D", "y", "\x1b[4~",
+  };
+  int sessionlen = sizeof(session) / sizeof(session[0]);
+  int numkeys = sessions * sessionlen;
+  char **script = malloc(numkeys * sizeof(char *));
+  for (int i = 0; i < numkeys; i++)
+    script[i] = session[i % sessionlen];
+
+  int sizes[][2] = {{24, 80}, {60, 200}};
+  for (int s = 0; s < 2; s++)
   {
-    abAppend(&ab, "\x1b[K", 3);
-    if (y < rowCount - 1)
-      abAppend(&ab, "\r\n", 2);
+    vtAttach(sizes[s][0], sizes[s][1]);
+    editorOpen(filename);
+    editorResize();
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    E.statusmsg[0] = '\0';
+    vtScript(script, numkeys);
+
+    int frames = 0, badframes = 0;
+    double checking = 0;
+    double start = benchNow();
+    while (1)
+    {
+      editorRefreshScreen();
+      frames++;
+      double checkstart = benchNow();
+      if (benchVtMismatches())
+        badframes++;
+      checking += benchNow() - checkstart;
+      if (vt.nextkey == vt.numkeys && input.head == input.tail)
+        break;
+      // The frame is due as soon as the queued keys are handled.
+      E.frametick = GetTickCount() - WILO_FRAME_MS;
+      editorProcessInput(WILO_INPUT_BUDGET_MS);
+    }
+    double elapsed = benchNow() - start - checking;
+    printf("%3dx%-3d: %6d reads, %6d frames, %6.1f us/read, %7.1f bytes/read, %d frames differ\n",
+           vt.grid.rows, vt.grid.cols, numkeys, frames, elapsed * 1e6 / numkeys,
+           (double)vt.bytes / numkeys, badframes);
+    if (badframes)
+      benchFailures++;
+
+    vtDetach();
+    benchClearRows();
+    pieceFree();
+    free(E.filename);
+    E.filename = NULL;
+    E.syntax = NULL;
   }
-  abAppend(&ab, "\x1b[?25h", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
-  write(ab.b, ab.len);
-  abFree(&ab);
+  free(script);
+  remove(filename);
 }
 
-/*** input ***/
-
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+// Builds a corpus of NUL-terminated source lines, about megabytes MB, and
+// compares a strstr loop over the lines with the search engine, per line and
+// as one block.
+void benchSearch(int argc, char **argv)
 {
-  size_t bufsize = 128;
-  char *buf = malloc(bufsize);
-
-  size_t buflen = 0;
-  buf[0] = '\0';
+  size_t megabytes = argc > 0 ? atoi(argv[0]) : 1024;
+  size_t size = megabytes << 20;
+  static char *lines[] = {
+      "static int table_%d[] = {1, 2, 3, 0x40, 3.25};",
+      "int function_%d(char *s, unsigned long n)",
+      "\tif (s[n] == '\\'' || strcmp(s, \"%d: \\\"quoted\\\"\") == 0) // compare",
+      "\tfor (int i = 0; i < n; i++) { total += i * 2; } // %d",
+      "%08d: the quick brown fox jumps over the lazy dog",
+  };
+  int numtemplates = sizeof(lines) / sizeof(lines[0]);
+
+  char *corpus = malloc(size + 128);
+  int numlines = 0, cap = 1024;
+  size_t *starts = malloc(cap * sizeof(size_t));
+  size_t used = 0;
+  while (used + 128 < size)
+  {
+    if (numlines == cap)
+    {
+      cap *= 2;
+      starts = realloc(starts, cap * sizeof(size_t));
+    }
+    starts[numlines] = used;
+    used += snprintf(&corpus[used], 128, lines[numlines % numtemplates], numlines) + 1;
+    numlines++;
+  }
+  printf("%d lines, %.1f MB\n", numlines, used / 1048576.0);
 
-  while (1)
+  struct
   {
-    editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    char *query;
+    int icase;
+  } cases[] = {{"lazy cat", 0}, {"lazy cat", 1}, {"Total", 1}, {"brown fox", 0}, {"x", 0}};
+  searchPattern p = {0};
+  for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+    char *query = cases[c].query;
+    int qlen = strlen(query);
+    searchCompile(&p, query, qlen, cases[c].icase);
 
-    int c = editorReadKey();
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    int found = 0;
+    double start = benchNow();
+    if (!cases[c].icase)
     {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
+      for (int i = 0; i < numlines; i++)
+        found += strstr(&corpus[starts[i]], query) != NULL;
     }
-    else if (c == '\x1b')
+    double strstrtime = benchNow() - start;
+
+    int matched = 0;
+    start = benchNow();
+    for (int i = 0; i < numlines; i++)
     {
-      editorSetStatusMessage("");
-      if (callback)
-        callback(buf, c);
-      free(buf);
-      return NULL;
+      size_t end = i + 1 < numlines ? starts[i + 1] - 1 : used - 1;
+      matched += searchFind(&p, &corpus[starts[i]], (int)(end - starts[i]), 0) != -1;
     }
-    else if (c == '\r')
+    double rowtime = benchNow() - start;
+
+    // The block scan counts every occurrence, lines included.
+    int occurrences = 0;
+    start = benchNow();
+    for (size_t at = 0; at < used;)
     {
-      if (buflen != 0)
+      int chunk = used - at > 0x40000000 ? 0x40000000 : (int)(used - at);
+      int from = 0, m;
+      while ((m = searchFind(&p, &corpus[at], chunk, from)) != -1)
       {
-        editorSetStatusMessage("");
-        if (callback)
-          callback(buf, c);
-        return buf;
+        occurrences++;
+        from = m + 1;
       }
+      at += chunk;
     }
-    else if (!iscntrl(c) && c < 128)
+    double blocktime = benchNow() - start;
+
+    char name[32];
+    snprintf(name, sizeof(name), "\"%s\"%s", query, cases[c].icase ? " nocase" : "");
+    if (cases[c].icase)
+      printf("%-18s strstr        -, rows %5.2f GB/s, block %5.2f GB/s, %d rows\n", name,
+             used / rowtime / 1e9, used / blocktime / 1e9, matched);
+    else
+      printf("%-18s strstr %5.2f GB/s, rows %5.2f GB/s, block %5.2f GB/s, %d rows\n", name,
+             used / strstrtime / 1e9, used / rowtime / 1e9, used / blocktime / 1e9, matched);
+    if (!cases[c].icase && found != matched)
     {
-      if (buflen == bufsize - 1)
-      {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
-      }
-      buf[buflen++] = c;
-      buf[buflen] = '\0';
+      printf("strstr found %d rows\n", found);
+      benchFailures++;
     }
-
-    if (callback)
-      callback(buf, c);
   }
+
+  searchFree(&p);
+  free(starts);
+  free(corpus);
+
+  // The prompt used to render every row it passed and strstr the render.
+  char *filename = "wilo_bench_search.c";
+  int numrows = 200000;
+  benchWriteSource(filename, numrows, 1);
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+
+  double start = benchNow();
+  editorFindCallback("lazy cat", 'l');
+  double engine = benchNow() - start;
+
+  start = benchNow();
+  int found = 0;
+  for (int i = 0; i < E.numrows; i++)
+    found += strstr(editorRowRender(i)->render, "lazy cat") != NULL;
+  double rendered = benchNow() - start;
+  editorFindCallback("", '\x1b');
+  printf("find in %d rows: render and strstr %.1f ms, search engine %.1f ms\n", numrows,
+         rendered * 1e3, engine * 1e3);
+
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
 }
 
-void editorMoveCursor(int key)
+// Finds every match in a large file with the worker pool and on one thread,
+// then times stepping through the list and a scan cancelled by a key.
+void benchFind(int argc, char **argv)
 {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_find.c";
+  benchWriteSource(filename, numrows, 1);
+  editorOpen(filename);
+  E.screenrows = 58;
+  E.screencols = 200;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+
+  char *queries[] = {"total", "quoted", "s", "lazy cat"};
+  searchPattern p = {0};
+  for (int q = 0; q < 4; q++)
+  {
+    searchCompile(&p, queries[q], strlen(queries[q]), 0);
+
+    double start = benchNow();
+    editorFindAll(&p, NULL, E.numrows);
+    double pooled = benchNow() - start;
+
+    // The same chunks, one after another on this thread.
+    findChunk chunk = {NULL, 0, 0};
+    findJob job = {&p, NULL, E.numrows, 0, &chunk};
+    int serial = 0;
+    start = benchNow();
+    for (job.first = 0; job.first * WILO_FIND_CHUNK_ROWS < E.numrows; job.first++)
+    {
+      editorFindScan(0, 0, &job);
+      serial += chunk.count;
+    }
+    double single = benchNow() - start;
+    free(chunk.matches);
 
-  switch (key)
+    printf("%-10s %8d matches: %6.1f ms with %d workers, %6.1f ms on one thread\n", queries[q],
+           found.count, pooled * 1e3, poolSize(), single * 1e3);
+    if (serial != found.count)
+      benchFailures++;
+  }
+
+  // Stepping through the list.
+  editorFindCallback("s", 's');
+  int steps = 1000000;
+  double start = benchNow();
+  for (int i = 0; i < steps; i++)
+    editorFindCallback("s", ARROW_DOWN);
+  printf("next match: %.3f us/step through %d matches\n", (benchNow() - start) * 1e6 / steps, found.count);
+
+  // Typing a query one key at a time, narrowing the previous matches and
+  // scanning every row for each key.
+  char *typed = "table_99999";
+  for (int narrow = 1; narrow >= 0; narrow--)
   {
-  case ARROW_LEFT:
-    if (E.cx != 0)
+    found.fromrow = found.fromcol = 0;
+    double first = 0, rest = 0, last = 0;
+    for (int n = 1; typed[n - 1]; n++)
     {
-      E.cx--;
+      char query[16];
+      memcpy(query, typed, n);
+      query[n] = '\0';
+      if (!narrow)
+        editorFindClearBase();
+      start = benchNow();
+      editorFindCallback(query, query[n - 1]);
+      last = benchNow() - start;
+      if (n == 1)
+        first = last;
+      else
+        rest += last;
     }
-    else if (E.cy > 0)
+    printf("type \"%s\" %s: first key %5.1f ms, then %5.2f ms/key, last key %6.3f ms, %d matches\n",
+           typed, narrow ? "narrowing " : "full scans", first * 1e3, rest * 1e3 / (strlen(typed) - 1),
+           last * 1e3, found.count);
+    editorFindCallback("", '\x1b');
+  }
+
+  // A key waiting in the ring stops the scan after its first round.
+  searchCompile(&p, "s", 1, 0);
+  inputPush('x', 1);
+  start = benchNow();
+  editorFindAll(&p, NULL, E.numrows);
+  printf("cancelled scan: %.2f ms, %s\n", (benchNow() - start) * 1e3, found.complete ? "completed" : "stopped");
+  if (found.complete)
+    benchFailures++;
+  input.head = input.tail = 0;
+
+  editorFindCallback("", '\x1b');
+  searchFree(&p);
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+int benchIndexDone()
+{
+  return trigrams.lists != NULL;
+}
+
+// Finds every match of p with the index, returning the number of candidate
+// rows or -1 for a scan of all rows.
+int benchIndexFind(searchPattern *p, const char *query)
+{
+  int *indexed;
+  int n = editorIndexCandidates(query, strlen(query), &indexed);
+  if (n < 0)
+  {
+    editorFindAll(p, NULL, E.numrows);
+    return -1;
+  }
+  findMatch *rows = malloc(sizeof(findMatch) * (n + 1));
+  for (int i = 0; i < n; i++)
+  {
+    rows[i].row = indexed[i];
+    rows[i].col = 0;
+    rows[i].len = 0;
+  }
+  editorFindAll(p, rows, n);
+  free(rows);
+  free(indexed);
+  return n;
+}
+
+// Checks the indexed matches of every query against a scan of all rows.
+void benchIndexQueries(char **queries, int numqueries, int reps)
+{
+  searchPattern p = {0};
+  for (int q = 0; q < numqueries; q++)
+  {
+    searchCompile(&p, queries[q], strlen(queries[q]), searchQueryIgnoresCase(queries[q]));
+
+    double start = benchNow();
+    for (int i = 0; i < reps; i++)
+      editorFindAll(&p, NULL, E.numrows);
+    double scan = (benchNow() - start) / reps;
+    int count = found.count;
+    findMatch *expect = malloc(sizeof(findMatch) * (count + 1));
+    if (count)
+      memcpy(expect, found.matches, sizeof(findMatch) * count);
+
+    start = benchNow();
+    int candidates = benchIndexFind(&p, queries[q]);
+    double first = benchNow() - start;
+    start = benchNow();
+    for (int i = 0; i < reps; i++)
+      benchIndexFind(&p, queries[q]);
+    double indexed = (benchNow() - start) / reps;
+
+    char rows[16] = "all";
+    if (candidates >= 0)
+      snprintf(rows, sizeof(rows), "%d", candidates);
+    printf("%-10s %7d matches in %7s candidate rows: %8.3f ms indexed (first %.3f ms), %6.2f ms scanning\n",
+           queries[q], count, rows, indexed * 1e3, first * 1e3, scan * 1e3);
+    if (found.count != count || (count && memcmp(found.matches, expect, sizeof(findMatch) * count)))
+      benchFailures++;
+    free(expect);
+  }
+  searchFree(&p);
+}
+
+void benchIndex(int argc, char **argv)
+{
+  int numrows = argc > 0 ? atoi(argv[0]) : 1000000;
+  char *filename = "wilo_bench_index.log";
+  benchWriteFile(filename, numrows);
+
+  trigrams.enabled = 1;
+  double start = benchNow();
+  editorOpen(filename);
+  double opened = benchNow() - start;
+  benchIdleUntil(benchIndexDone);
+  double built = benchNow() - start;
+  printf("open %d rows: %.1f ms, index built in the background %.1f ms after\n", numrows, opened * 1e3,
+         (built - opened) * 1e3);
+  printf("index memory %.1f MB for a %.1f MB file\n", editorIndexMemory() / 1048576.0,
+         E.pt.origlen / 1048576.0);
+
+  char *queries[] = {"00424242", "99999", "brown fox", "missing"};
+  benchIndexQueries(queries, 4, 10);
+
+  // Edits that add and remove matches, by character and by row.
+  for (int i = 0; i < 1000; i++)
+  {
+    erow *row = editorRowAt((i * 7919) % E.numrows);
+    for (int k = 0; k < 3; k++)
+      editorRowDelChar(row, 0);
+    editorRowInsertChar(row, 0, 'x');
+    editorInsertRow((i * 104729) % E.numrows, "missing 00424242", 16);
+    editorDelRow((i * 611953) % E.numrows);
+  }
+  start = benchNow();
+  int *indexed;
+  editorIndexCandidates("missing", 7, &indexed);
+  free(indexed);
+  printf("after 3000 row edits: brought up to date in %.2f ms, index memory %.1f MB\n", (benchNow() - start) * 1e3,
+         editorIndexMemory() / 1048576.0);
+  benchIndexQueries(queries, 4, 10);
+
+  editorFindCallback("", '\x1b');
+  benchClearRows();
+  pieceFree();
+  indexListsFree(trigrams.lists);
+  trigrams.lists = NULL;
+  trigrams.enabled = 0;
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
+}
+
+// Every match of a pattern in one string, as "start-end," pairs.
+void benchRegexMatches(regex *re, const char *s, char *out, int outlen)
+{
+  int len = strlen(s), n = 0, end;
+  out[0] = '\0';
+  if (!regexMarkStarts(re, 0, s, len))
+    return;
+  for (int m = regexNext(re, 0, s, len, 0, &end); m != -1 && n < outlen - 24; m = regexNext(re, 0, s, len, end, &end))
+    n += snprintf(out + n, outlen - n, "%d-%d,", m, end);
+}
+
+void benchRegexRows(char c, int rows, int cols)
+{
+  char *line = malloc(cols);
+  unsigned int seed = 1;
+  for (int i = 0; i < rows; i++)
+  {
+    for (int j = 0; j < cols; j++)
     {
-      E.cy--;
-      E.cx = E.row[E.cy].size;
+      seed = seed * 1103515245 + 12345;
+      line[j] = c ? c : "ab"[(seed >> 16) & 1];
     }
-    break;
-  case ARROW_RIGHT:
-    if (row && E.cx < row->size)
+    editorInsertRow(E.numrows, line, cols);
+  }
+  free(line);
+}
+
+void benchRegex(int argc, char **argv)
+{
+  int megabytes = argc > 0 ? atoi(argv[0]) : 4;
+
+  // Leftmost-longest semantics, anchors, classes and case.
+  static char *checks[][3] = {
+      {"a|ab", "abab", "0-2,2-4,"},
+      {"colou?r", "color colour", "0-5,6-12,"},
+      {"^ab", "abab", "0-2,"},
+      {"ab$", "abab", "2-4,"},
+      {"(a|b)*c", "xababcx", "1-6,"},
+      {"a{2,3}", "aaaaaaa", "0-3,3-6,"},
+      {"[^a-c]+", "abcxyzab", "3-6,"},
+      {"\\d{4}-\\d\\d-\\d\\d", "on 2024-05-01.", "3-13,"},
+      {"\\w+@\\w+\\.com", "mail bob@example.com now", "5-20,"},
+      {"x*", "aaa", ""},
+      {"hello", "Hello HELLO", "0-5,6-11,"},
+      {"Hello", "Hello HELLO", "0-5,"},
+      {"\\S+", " ab  c", "1-3,5-6,"},
+      {"(^a|b)+", "abab", "0-2,3-4,"},
+  };
+  int numchecks = sizeof(checks) / sizeof(checks[0]);
+  int passed = 0;
+  for (int i = 0; i < numchecks; i++)
+  {
+    const char *error = NULL;
+    regex *re = regexCompile(checks[i][0], strlen(checks[i][0]), regexIgnoresCase(checks[i][0]), &error);
+    char got[256] = "?";
+    if (re)
+      benchRegexMatches(re, checks[i][1], got, sizeof(got));
+    if (!strcmp(got, checks[i][2]))
+      passed++;
+    else
+      printf("  %s on \"%s\": %s, expected %s\n", checks[i][0], checks[i][1], got, checks[i][2]);
+    regexFree(re);
+  }
+  char *invalid[] = {"(ab", "ab)", "[ab", "*a", "a{3,2}", "a\\"};
+  for (int i = 0; i < 6; i++)
+  {
+    const char *error = NULL;
+    regex *re = regexCompile(invalid[i], strlen(invalid[i]), 0, &error);
+    if (re == NULL && error)
+      passed++;
+    else
+      printf("  %s: compiled\n", invalid[i]);
+    regexFree(re);
+  }
+  printf("%d of %d checks passed\n", passed, numchecks + 6);
+  if (passed != numchecks + 6)
+    benchFailures++;
+
+  // Patterns that take a backtracking matcher exponential time, and ones
+  // whose DFA has more states than the cache holds, on rows of 'a', 'x' or
+  // random 'a' and 'b'. The time per byte should not grow with the input;
+  // caches that thrash go over to the NFA.
+  struct
+  {
+    char *pattern;
+    char fill;
+  } slow[] = {
+      {"(a+)+b", 'a'},
+      {"(a|aa)*c", 'a'},
+      {"(a*)*(b|$)", 'a'},
+      {"(x+x+)+y", 'x'},
+      {"(.*a){20}", 'a'},
+      {"(a|a?)+?b", 'a'},
+      {"[ab]*a[ab]{12}$", 0},
+      {"(a|b)*a(a|b){14}b", 0},
+  };
+  int cols = 1000;
+  for (int i = 0; i < (int)(sizeof(slow) / sizeof(slow[0])); i++)
+  {
+    searchPattern p = {0};
+    const char *error = searchCompileRegex(&p, slow[i].pattern);
+    if (error)
     {
-      E.cx++;
+      printf("%s: %s\n", slow[i].pattern, error);
+      benchFailures++;
+      continue;
     }
-    else if (row && E.cx == row->size)
+    double ns[2];
+    int count = 0;
+    for (int size = 0; size < 2; size++)
     {
-      E.cy++;
-      E.cx = 0;
+      int rows = (size ? megabytes : megabytes / 4 > 0 ? megabytes / 4 : 1) * 1048576 / cols;
+      benchRegexRows(slow[i].fill, rows, cols);
+      double start = benchNow();
+      editorFindAll(&p, NULL, E.numrows);
+      ns[size] = (benchNow() - start) * 1e9 / ((double)rows * cols);
+      count = found.count;
+      benchClearRows();
     }
-    break;
-  case ARROW_UP:
-    if (E.cy != 0)
+    unsigned long flushes = 0;
+    int states = 0, nfa = 0;
+    for (int w = 0; w < 2 * WILO_MAX_WORKERS; w++)
     {
-      E.cy--;
+      flushes += p.re->caches[w].flushes;
+      states += p.re->caches[w].numstates;
+      nfa += p.re->caches[w].nfa;
     }
-    break;
-  case ARROW_DOWN:
-    if (E.cy < E.numrows)
+    printf("%-20s %7d matches: %6.2f ns/byte, %6.2f ns/byte at 4x the input, %5d states cached, %lu flushes, %d on the NFA\n",
+           slow[i].pattern, count, ns[0], ns[1], states, flushes, nfa);
+    searchFree(&p);
+  }
+
+  // Every offset of a row of 'a' starts a match, but the forward DFA only
+  // dies at the end of the row. The time per byte should not grow with the
+  // length of the row.
+  {
+    searchPattern p = {0};
+    searchCompileRegex(&p, "a|a[^x]*x");
+    double ns[2];
+    int count[2];
+    for (int size = 0; size < 2; size++)
     {
-      E.cy++;
+      int rowlen = size ? 40000 : 10000;
+      benchRegexRows('a', 1, rowlen);
+      double start = benchNow();
+      editorFindAll(&p, NULL, E.numrows);
+      ns[size] = (benchNow() - start) * 1e9 / rowlen;
+      count[size] = found.count;
+      benchClearRows();
     }
-    break;
+    printf("%-20s %7d matches: %6.2f ns/byte on a 10k row, %6.2f ns/byte on a 40k row\n", "a|a[^x]*x",
+           count[1], ns[0], ns[1]);
+    if (count[0] != 10000 || count[1] != 40000)
+      benchFailures++;
+    searchFree(&p);
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen)
+  // A log file, and literal patterns checked against the literal search.
+  int numrows = megabytes * 1048576 / 48;
+  char *filename = "wilo_bench_regex.log";
+  benchWriteFile(filename, numrows);
+  editorOpen(filename);
+  char *queries[][2] = {
+      {"quick brown", "quick brown"},
+      {"00424242", "00424242"},
+      {"^\\d+7: the", NULL},
+      {"0042\\d*9", NULL},
+      {"(fox|dog)$", NULL},
+      {"jumps? (over|under)", NULL},
+  };
+  for (int q = 0; q < 6; q++)
   {
-    E.cx = rowlen;
+    searchPattern p = {0};
+    searchCompileRegex(&p, queries[q][0]);
+    double start = benchNow();
+    editorFindAll(&p, NULL, E.numrows);
+    double regexed = benchNow() - start;
+    int count = found.count;
+    findMatch *expect = malloc(sizeof(findMatch) * (count + 1));
+    if (count)
+      memcpy(expect, found.matches, sizeof(findMatch) * count);
+
+    printf("%-20s %7d matches: %6.1f ms, %.2f ns/byte", queries[q][0], count, regexed * 1e3,
+           regexed * 1e9 / E.pt.origlen);
+    if (queries[q][1])
+    {
+      searchCompile(&p, queries[q][1], strlen(queries[q][1]), 0);
+      start = benchNow();
+      editorFindAll(&p, NULL, E.numrows);
+      printf(", literal search %.1f ms", (benchNow() - start) * 1e3);
+      if (found.count != count || (count && memcmp(found.matches, expect, sizeof(findMatch) * count)))
+        benchFailures++;
+    }
+    printf("\n");
+    free(expect);
+    searchFree(&p);
   }
+
+  benchClearRows();
+  pieceFree();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  remove(filename);
 }
 
-void editorProcessKeyPress()
+typedef struct benchCase
 {
-  static int quit_times = WILO_QUIT_TIMES;
+  char *name;
+  void (*run)(int argc, char **argv);
+} benchCase;
+
+benchCase BENCHES[] = {
+    {"rows", benchRows},
+    {"piece", benchPiece},
+    {"open", benchOpen},
+    {"lazy", benchLazy},
+    {"cascade", benchCascade},
+    {"keywords", benchKeywords},
+    {"lexer", benchLexer},
+    {"spans", benchSpans},
+    {"parallel", benchParallel},
+    {"typing", benchTyping},
+    {"screen", benchScreen},
+    {"frame", benchFrame},
+    {"scroll", benchScroll},
+    {"input", benchInput},
+    {"paste", benchPaste},
+    {"idle", benchIdle},
+    {"vt", benchVt},
+    {"search", benchSearch},
+    {"find", benchFind},
+    {"index", benchIndex},
+    {"regex", benchRegex},
+};
 
-  int c = editorReadKey();
-  switch (c)
-  {
-  case '\r':
-    editorInsertNewLine();
-    break;
-  case CTRL_KEY('q'):
-    if (E.dirty && quit_times > 0)
-    {
-      editorSetStatusMessage("WARNING!!! File has unsaved changes."
-                             "Press CTRL-Q %d more times to quit",
-                             quit_times);
-      quit_times--;
-      return;
-    }
-    editorClearScreen();
-    exit(0);
-    break;
-  case CTRL_KEY('s'):
-    editorSave();
-    break;
-  case HOME_KEY:
-    E.cx = 0;
-    break;
-  case END_KEY:
-    if (E.cy < E.numrows)
-      E.cx = E.row[E.cy].size;
-    break;
-  case CTRL_KEY('f'):
-    editorFind();
-    break;
-  case BACKSPACE:
-  case CTRL_KEY('h'):
-  case DEL_KEY:
-    if (c == DEL_KEY)
-      editorMoveCursor(ARROW_RIGHT);
-    editorDelChar();
-    break;
-  case PAGE_UP:
-  case PAGE_DOWN:
+#define BENCH_ENTRIES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+int editorBenchMain(int argc, char **argv)
+{
+  for (unsigned int i = 0; i < BENCH_ENTRIES; i++)
   {
-    if (c == PAGE_UP)
-    {
-      E.cy = E.rowoff;
-    }
-    else if (c == PAGE_DOWN)
+    if (argc == 0 || !strcmp(argv[0], BENCHES[i].name))
     {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
+      printf("== %s ==\n", BENCHES[i].name);
+      BENCHES[i].run(argc ? argc - 1 : 0, argc ? argv + 1 : NULL);
     }
-    int times = E.screenrows;
-    while (times--)
-      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-  }
-  break;
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-  case ARROW_UP:
-  case ARROW_DOWN:
-    editorMoveCursor(c);
-    break;
-  case CTRL_KEY('l'):
-  case '\x1b':
-  case 0:
-    break;
-  default:
-    editorInsertChar(c);
-    break;
   }
-
-  quit_times = WILO_QUIT_TIMES;
+  return benchFailures != 0;
 }
 
+#endif
+
 /*** init ***/
 void initEditor()
 {
@@ -1481,28 +7665,66 @@ void initEditor()
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
+  E.rowcap = 0;
+  E.rowgap = 0;
+  E.hlvalid = 0;
+  E.hlepoch = 0;
+  E.rowversion = 0;
+  E.hldiscarded = 0;
+  E.redraw = 0;
+  E.scratch.render = NULL;
+  E.scratch.hl = NULL;
+  E.scratch.cap = 0;
+  E.piecetable = 0;
+  E.pt.orig = NULL;
+  E.pt.origlen = 0;
+  E.pt.origowned = 0;
+  E.pt.add = NULL;
+  E.pt.addlen = 0;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
-  E.statusmsg_time = 0;
   E.syntax = NULL;
+  E.match.row = -1;
+  memset(&E.frame, 0, sizeof(E.frame));
+  memset(&E.shadow, 0, sizeof(E.shadow));
+  E.shadowvalid = 0;
+  E.shadowrowoff = 0;
+  memset(&E.rowcache, 0, sizeof(E.rowcache));
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
 
   E.screenrows -= 2;
+#ifdef _WIN32
   FlushConsoleInputBuffer(E.hStdin);
+#endif
 }
 
 int main(int argc, char *argv[])
 {
+#ifdef WILO_BENCH
+  if (argc >= 2 && !strcmp(argv[1], "--bench"))
+    return editorBenchMain(argc - 2, argv + 2);
+#endif
+
+#ifdef _WIN32
   E.hStdin = GetStdHandle(STD_INPUT_HANDLE);
   E.hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+#endif
   enableRawMode();
   initEditor();
-  if (argc >= 2)
+  int argi = 1;
+  for (; argi < argc && (!strcmp(argv[argi], "-p") || !strcmp(argv[argi], "-i")); argi++)
+  {
+    if (argv[argi][1] == 'p')
+      E.piecetable = 1;
+    else
+      trigrams.enabled = 1;
+  }
+  if (argi < argc)
   {
-    editorOpen(argv[1]);
+    editorOpen(argv[argi]);
   }
 
   editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
@@ -1510,7 +7732,7 @@ int main(int argc, char *argv[])
   while (1)
   {
     editorRefreshScreen();
-    editorProcessKeyPress();
+    editorProcessInput(WILO_INPUT_BUDGET_MS);
   }
 
   return 0;